@@ -22,19 +22,28 @@
 #include <fcntl.h>
 #include <math.h>
 #include <poll.h>
+#include <pthread.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <drm.h>
+#include <drm_fourcc.h>
 #include <drm_mode.h>
 
+#include <linux/dma-buf.h>
+#include <linux/media.h>
 #include <linux/videodev2.h>
 
 #include <xf86drm.h>
@@ -69,13 +78,65 @@ static inline int warn(const char *file, int line, const char *fmt, ...)
 #define WARN_ON(cond, ...) \
 	((cond) ? warn(__FILE__, __LINE__, __VA_ARGS__) : 0)
 
-struct setup {
-	char module[32];
+#define MAX_OUTPUTS 8
+/* no plane width limit found in practice is narrower than this */
+#define TILE_MIN_WIDTH 1920
+
+#ifndef DRM_CAP_ATOMIC_ASYNC_PAGE_FLIP
+#define DRM_CAP_ATOMIC_ASYNC_PAGE_FLIP 0x15
+#endif
+
+struct plane_props {
+	uint32_t fb_id;
+	uint32_t crtc_id;
+	uint32_t src_x, src_y, src_w, src_h;
+	uint32_t crtc_x, crtc_y, crtc_w, crtc_h;
+	/* optional, 0 if the plane does not have them */
+	uint32_t zpos;
+	uint32_t alpha;
+	uint32_t damage;
+};
+
+/* a plane on a CRTC showing a captured stream */
+struct output {
+	struct stream *stream;
 	int conId;
 	uint32_t crtcId;
 	int crtcIdx;
 	uint32_t planeId;
+	struct plane_props props;
+	/* part of the frame shown by the plane, 16.16 fixed point */
+	uint32_t src_x, src_y, src_w, src_h;
+	struct v4l2_rect compose;
+	drmModeModeInfo mode;
+	uint64_t zpos;
+	uint64_t alpha;
+	/* buffer being scanned out, or -1 */
+	int shown;
+	/* buffer committed but not flipped to yet, or -1 */
+	int pending;
+	/* fullscreen on the primary plane, no overlay was usable */
+	unsigned int primary : 1;
+};
+
+struct setup {
+	char module[32];
+	struct output out[MAX_OUTPUTS];
+	unsigned int out_count;
+	unsigned int atomic : 1;
+	/* video wall grid, outputs fill it row by row */
+	unsigned int wall_cols, wall_rows;
+	/* gaps between the active areas of adjacent displays, in pixels */
+	unsigned int bezel_h, bezel_v;
+	/* widest source a single plane can scan out, 0 if unknown */
+	unsigned int tile_width;
 	char video[32];
+	char pip[32];
+	/* right eye of a stereo pair */
+	char stereo[32];
+	char meta[32];
+	char media[32];
+	char control[108];
 	unsigned int w, h;
 	unsigned int use_wh : 1;
 	unsigned int in_fourcc;
@@ -83,35 +144,438 @@ struct setup {
 	unsigned int buffer_count;
 	unsigned int use_crop : 1;
 	unsigned int use_compose : 1;
+	unsigned int use_pip_compose : 1;
 	struct v4l2_rect crop;
 	struct v4l2_rect compose;
+	struct v4l2_rect pip_compose;
+	/* plane alpha of the picture-in-picture, 0 - 0xffff */
+	unsigned int pip_alpha;
+	/* fastest refresh rate among the outputs */
+	unsigned int vrefresh;
+	struct v4l2_fract interval;
+	unsigned int plan : 1;
+	unsigned int use_overlay : 1;
+	unsigned int use_damage : 1;
+	/* hash every n-th row to drop repeated frames, 0 to disable */
+	unsigned int dedup_stride;
+	unsigned int fps;
+	unsigned int decimate;
+	/* software decimation when the driver cannot lower its rate */
+	unsigned int skip;
+	unsigned int analyze : 1;
+	/* preview file, written every thumb_every frames */
+	char thumb[108];
+	unsigned int thumb_every;
+	char trace[108];
+	char replay[108];
+	/* flip as soon as a frame arrives, even if it tears */
+	unsigned int async : 1;
+	unsigned int use_drift : 1;
+	unsigned int use_qos : 1;
+	/* DRM lease inherited from a lessor, used instead of the module */
+	unsigned int use_lease : 1;
+	int lease_fd;
+	/* second device to import frames into */
+	char import[32];
 };
 
 struct buffer {
 	unsigned int bo_handle;
 	unsigned int fb_handle;
 	int dbuf_fd;
+	/* CPU mapping, or NULL */
+	void *map;
+	size_t size;
+	uint32_t sequence;
+	/* capture time, CLOCK_MONOTONIC */
+	uint64_t timestamp;
+	/* outputs showing it, the waiting slot and CPU readers */
+	unsigned int refs;
+	/* metadata buffer captured with this frame, or -1 */
+	int meta;
+	/* media request the buffer is queued with, or -1 */
+	int request_fd;
+	/* number of controls bound to the buffer's request */
+	unsigned int request_ctrls;
+};
+
+struct meta_buffer {
+	void *data;
+	size_t length;
+	unsigned int bytesused;
+	uint32_t sequence;
+	/* dequeued and waiting for the video frame with the same sequence */
+	int waiting;
+};
+
+struct meta_stream {
+	int fd;
+	unsigned int count;
+	struct meta_buffer *buffer;
+	unsigned int matched;
+	unsigned int dropped;
+};
+
+#define THUMB_MAGIC 0x424d4854	/* "THMB" */
+/* downscale factor of previews, also the lane count of v8u16 */
+#define THUMB_SCALE 8
+#define THUMB_MAX_STREAMS 2
+
+typedef uint8_t v8u8 __attribute__((vector_size(8)));
+typedef uint16_t v8u16 __attribute__((vector_size(16)));
+
+/* shared with monitoring clients, 8 bit grey previews */
+struct thumb_slot {
+	/* odd while the slot is being rewritten */
+	uint32_t seq;
+	uint32_t width, height;
+	uint32_t sequence;
+	uint64_t timestamp;
+	uint8_t pixels[];
+};
+
+struct thumb_file {
+	uint32_t magic;
+	uint32_t count;
+	/* from the start of the file */
+	uint32_t offset[THUMB_MAX_STREAMS];
 };
 
 struct stream {
 	int v4lfd;
+	/* framebuffer size and format */
+	unsigned int w, h;
+	uint32_t fourcc;
+	uint32_t pitch;
+	/* latest frame held by the display, or -1 */
 	int current_buffer;
+	/* newest frame waiting for the display to be free, or -1 */
+	int next_buffer;
 	int buffer_count;
 	struct buffer *buffer;
-} stream;
+	/* bytes allocated per buffer */
+	uint64_t buffer_size;
+	/* V4L2_BUF_CAP_* of the capture queue */
+	uint32_t caps;
+	/* hash of the last frame sent to the display */
+	uint64_t last_hash;
+	int last_hash_valid;
+	struct meta_stream meta;
+	int mediafd;
+	/* preview slot, or NULL */
+	struct thumb_slot *thumb;
+	unsigned int thumb_skip;
+	unsigned int luma_offset, luma_step;
+	uint8_t *row;
+	v8u16 *acc;
+	/* stream whose buffers this view shows, or NULL */
+	struct stream *source;
+	const char *name;
+	/* lower is more important */
+	unsigned int priority;
+	/* load shed by the QoS controller, see qos_levels */
+	unsigned int qos_level;
+	unsigned int qos_count;
+	/* frames replaced before the display took them */
+	unsigned int dropped;
+	unsigned int qos_dropped;
+} stream, pip, overlay, stereo;
+
+#define MAX_LESSEES 4
+#define MAX_LEASE_OBJECTS 16
+/* restarts of a crashed worker before its CRTC is given up */
+#define LEASE_RESPAWNS 3
+
+struct lessee {
+	uint32_t conId;
+	uint32_t crtcId;
+	char video[32];
+	/* connector, CRTC, then planes */
+	uint32_t objects[MAX_LEASE_OBJECTS];
+	unsigned int count;
+	uint32_t id;
+	pid_t pid;
+	unsigned int respawns;
+};
+
+/* workers running their own pipeline on a lease of ours */
+struct lessor {
+	unsigned int count;
+	struct lessee lessee[MAX_LESSEES];
+	/* arguments after "--", passed to every worker */
+	char **extra;
+	int extra_count;
+} lessor;
+
+#define MAX_IMPORTS 64
+
+struct import_entry {
+	/* identity of the dmabuf */
+	dev_t dev;
+	ino_t ino;
+	uint32_t handle;
+	uint32_t fb;
+	uint64_t last_use;
+};
+
+/* second DRM device the capture buffers are imported into */
+struct importer {
+	int fd;
+	int has_display;
+	struct setup setup;
+	struct output out;
+	unsigned int count;
+	struct import_entry entry[MAX_IMPORTS];
+	uint64_t tick;
+	unsigned int lookups;
+	unsigned int hits;
+	unsigned int imports;
+	unsigned int evictions;
+} importer = { .fd = -1 };
+
+#define MAX_SINK_BUFFERS 32
+/* buffers of the output device when frames have to be copied */
+#define SINK_COPY_BUFFERS 4
+
+/* V4L2 output device fed with captured frames */
+struct sink {
+	char node[32];
+	int fd;
+	int drmfd;
+	unsigned int count;
+	/* the device could not import dmabufs */
+	int copy;
+	uint32_t sizeimage;
+	uint32_t pitch;
+	/* queued to the device and not returned yet */
+	int queued[MAX_SINK_BUFFERS];
+	void *map[MAX_SINK_BUFFERS];
+	size_t length[MAX_SINK_BUFFERS];
+	unsigned int frames;
+	unsigned int skipped;
+} sink;
+
+/* a pipeline still streams with this many buffers */
+#define BUDGET_MIN_BUFFERS 3
+
+/* buffer memory shared by all pipelines */
+struct budget {
+	/* in bytes, 0 for no limit */
+	uint64_t limit;
+	uint64_t used;
+	unsigned int count;
+	struct stream *stream[4];
+} budget;
+
+#define QOS_WINDOW_US 1000000
+#define QOS_BUSY_HIGH 0.8
+#define QOS_BUSY_LOW 0.5
+/* calm windows before load is given back */
+#define QOS_CALM_WINDOWS 5
+#define QOS_MAX_LEVEL 3
+
+struct qos {
+	unsigned int count;
+	struct stream *stream[2];
+	/* priority of the streams that are never slowed down */
+	unsigned int top;
+	uint64_t since;
+	uint64_t idle;
+	unsigned int calm;
+	unsigned int degraded;
+	unsigned int restored;
+} qos;
+
+#define MAX_INPUTS MAX_OUTPUTS
+#define MUX_SETTLE_FRAMES 1
+
+/* inputs of one capture device, switched in turn */
+struct mux {
+	unsigned int count;
+	unsigned int input[MAX_INPUTS];
+	/* frames captured from an input before switching to the next */
+	unsigned int dwell;
+	struct stream *view[MAX_INPUTS];
+	struct stream views[MAX_INPUTS];
+	unsigned int current;
+	unsigned int frames;
+	/* frames still to discard after a switch */
+	unsigned int settle;
+	unsigned int switches;
+	unsigned int restarts;
+} mux;
+
+/* left and right frames captured within the tolerance are shown together */
+struct pairing {
+	int64_t tolerance;
+	/* unpaired frame of the left and right eye, or -1 */
+	int waiting[2];
+	unsigned int pairs;
+	unsigned int unpaired;
+	uint64_t skew_sum;
+	uint64_t skew_max;
+} pairing;
+
+#define MAX_PENDING_CTRLS 16
+#define MAX_SUBSCRIBERS 4
+
+struct control {
+	int fd;
+	/* control changes waiting for the next queued buffer */
+	unsigned int pending_count;
+	struct v4l2_ext_control pending[MAX_PENDING_CTRLS];
+	/* clients receiving per-frame analysis */
+	unsigned int subscriber_count;
+	struct sockaddr_un subscriber[MAX_SUBSCRIBERS];
+	socklen_t subscriber_len[MAX_SUBSCRIBERS];
+} control;
+
+#define MAX_LATENCY_SAMPLES 1024
+
+struct stats {
+	/* start of the current reporting period */
+	uint64_t since;
+	unsigned int frames_captured;
+	unsigned int frames_shown;
+	/* frames lost by capture or replaced before they were shown */
+	unsigned int drops;
+	uint32_t last_sequence;
+	/* capture to scanout in microseconds */
+	unsigned int latency_count;
+	uint32_t latency[MAX_LATENCY_SAMPLES];
+	/* commits skipped because the frame did not change */
+	unsigned int unchanged;
+	unsigned int commits;
+	/* frames requeued because they hashed like the previous one */
+	unsigned int deduplicated;
+	unsigned int hashed;
+	/* latest scene analysis */
+	unsigned int analysed;
+	double luma;
+	double motion;
+	/* capture, commit and flip times for offline replay, or NULL */
+	FILE *trace;
+} stats;
+
+/* drift is measured over windows of this length */
+#define DRIFT_WINDOW_US 10000000
+#define DRIFT_MIN_SAMPLES 100
+#define DRIFT_TOLERANCE_PPM 20
+#define DRIFT_MAX_ADJUSTMENTS 4
+
+struct clock_fit {
+	uint32_t count0;
+	uint64_t time0;
+	unsigned int n;
+	double sx, sy, sxx, sxy;
+};
+
+struct drift {
+	uint64_t since;
+	/* frame and vblank timestamps against their counters */
+	struct clock_fit capture;
+	struct clock_fit vblank;
+	/* capture clock relative to the display, positive when slower */
+	double ppm;
+	unsigned int adjustments;
+	/* the interval cannot be tuned any further */
+	int fixed;
+	/* last vblank counter read on the legacy path */
+	unsigned int last_vblank;
+} drift;
+
+#define DAMAGE_TILE_W 32
+#define DAMAGE_TILE_H 16
+#define MAX_DAMAGE_CLIPS 64
+
+struct damage {
+	unsigned int count;
+	/* damaged pixels */
+	uint64_t area;
+	struct drm_mode_rect rects[MAX_DAMAGE_CLIPS];
+};
+
+#define MOTION_BLOCK 16
+/* mean absolute luma difference for a block to count as moving */
+#define MOTION_THRESHOLD 8
+
+struct analysis {
+	uint32_t sequence;
+	uint32_t hist[256];
+	double mean;
+	double variance;
+	/* mean and peak per-pixel difference over all blocks */
+	double motion;
+	double motion_max;
+	unsigned int motion_blocks;
+};
+
+/*
+ * Scene statistics are computed on a worker thread from a cached copy of
+ * the luma plane. The main thread only hands over displayed buffers and
+ * collects results through a pipe it polls.
+ */
+struct analyzer {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	/* worker to main thread: 'c' buffer copied, 'd' analysis done */
+	int notify[2];
+	int busy;
+	int work;
+	struct buffer *buffer;
+	int index;
+	/* luma geometry of the captured format */
+	unsigned int w, h, pitch;
+	unsigned int offset, step;
+	/* current and previous frame, cached */
+	uint8_t *shadow[2];
+	int cur;
+	int have_prev;
+	uint8_t *row;
+	struct analysis result;
+} analyzer;
 
 static void usage(char *name)
 {
 	fprintf(stderr, "usage: %s [-Moisth]\n", name);
 	fprintf(stderr, "\t-M <drm-module>\tset DRM module\n");
-	fprintf(stderr, "\t-o <connector_id>:<crtc_id>\tchoose a connector/crtc\n");
+	fprintf(stderr, "\t-o <connector_id>:<crtc_id>\tchoose a connector/crtc, repeat to clone\n");
 	fprintf(stderr, "\t-i <video-node>\tset video node like /dev/video*\n");
-	fprintf(stderr, "\t-S <width,height>\tset input resolution\n");
+	fprintf(stderr, "\t-G <connector_id>:<crtc_id>:<video-node>\trun a worker process on a DRM lease, repeat for more; arguments after -- go to every worker\n");
+	fprintf(stderr, "\t-k <fd>\tuse an inherited DRM lease fd instead of the module\n");
+	fprintf(stderr, "\t-p <video-node>\tshow a second video node as picture-in-picture\n");
+	fprintf(stderr, "\t-P <width,height>@<left,top>\tset picture-in-picture area\n");
+	fprintf(stderr, "\t-A <alpha>\tset picture-in-picture opacity, 0-255\n");
+	fprintf(stderr, "\t-E <video-node>[,<ms>]\tshow a second video node as the right eye, pairing frames captured within ms (default 5)\n");
+	fprintf(stderr, "\t-I <input>,<input>...[@<frames>]\tcycle the video node through inputs, each in its own tile\n");
+	fprintf(stderr, "\t-Y <drm-module>\timport frames into a second DRM device, shown there if its display is lit\n");
+	fprintf(stderr, "\t-V <video-node>\tforward frames to an output device like v4l2loopback\n");
+	fprintf(stderr, "\t-m <meta-node>\tcapture metadata from node like /dev/video*\n");
+	fprintf(stderr, "\t-R <media-node>\tbind controls to buffers using requests on /dev/media*\n");
+	fprintf(stderr, "\t-C <socket-path>\tlisten for control commands on a unix socket\n");
+	fprintf(stderr, "\t-S <width,height>\tset input resolution (default: smallest covering compose area)\n");
 	fprintf(stderr, "\t-f <fourcc>\tset input format using 4cc\n");
 	fprintf(stderr, "\t-F <fourcc>\tset output format using 4cc\n");
 	fprintf(stderr, "\t-s <width,height>@<left,top>\tset crop area\n");
 	fprintf(stderr, "\t-t <width,height>@<left,top>\tset compose area\n");
+	fprintf(stderr, "\t-W <cols>x<rows>[,<bezel_h>,<bezel_v>]\tspan the stream over the outputs as a video wall\n");
+	fprintf(stderr, "\t-T <width>\tsplit frames wider than this across planes\n");
 	fprintf(stderr, "\t-b buffer_count\tset number of buffers\n");
+	fprintf(stderr, "\t-B <MiB>\tlimit buffer memory of all pipelines, shrinking less important ones\n");
+	fprintf(stderr, "\t-r <fps>\tset target capture rate (default: display refresh)\n");
+	fprintf(stderr, "\t-d <n>\tcapture only every n-th frame\n");
+	fprintf(stderr, "\t-n\tprint memory and bandwidth plan, do not stream\n");
+	fprintf(stderr, "\t-O\tshow statistics on an overlay plane\n");
+	fprintf(stderr, "\t-c\tpass changed regions as damage, skip unchanged frames\n");
+	fprintf(stderr, "\t-H <n>\thash every n-th row, drop frames identical to the last\n");
+	fprintf(stderr, "\t-a\tcompute luma histogram and motion of shown frames\n");
+	fprintf(stderr, "\t-v <path>[,<n>]\twrite 1/8 scale previews of every n-th frame to a file like /dev/shm/*\n");
+	fprintf(stderr, "\t-q <prio>[,<pip-prio>]\tshed load from less important streams first when overloaded, lower is more important\n");
+	fprintf(stderr, "\t-D\testimate camera to display clock drift and tune the capture interval\n");
+	fprintf(stderr, "\t-X\tflip without waiting for vblank, allows tearing, primary plane only\n");
+	fprintf(stderr, "\t-L <path>\trecord capture and flip timings to a trace\n");
+	fprintf(stderr, "\t-Q <path>\treplay a trace through each scheduling policy, do not stream\n");
 	fprintf(stderr, "\t-h\tshow this help\n");
 	fprintf(stderr, "\n\tDefault is to dump all info.\n");
 }
@@ -129,20 +593,112 @@ static int parse_args(int argc, char *argv[], struct setup *s)
 
 	int c, ret;
 	memset(s, 0, sizeof(*s));
+	s->pip_alpha = 0xffff;
 
-	while ((c = getopt(argc, argv, "M:o:i:S:f:F:s:t:b:h")) != -1) {
+	while ((c = getopt(argc, argv, "M:o:i:G:k:I:V:Y:p:P:A:E:m:R:C:S:f:F:s:t:W:T:b:B:r:d:nOcH:av:XDq:L:Q:h")) != -1) {
 		switch (c) {
 		case 'M':
 			strncpy(s->module, optarg, 31);
 			break;
 		case 'o':
-			ret = sscanf(optarg, "%u:%u", &s->conId, &s->crtcId);
+			if (WARN_ON(s->out_count == MAX_OUTPUTS,
+				    "too many outputs\n"))
+				return -1;
+			ret = sscanf(optarg, "%u:%u", &s->out[s->out_count].conId,
+				     &s->out[s->out_count].crtcId);
 			if (WARN_ON(ret != 2, "incorrect con/ctrc description\n"))
 				return -1;
+			s->out_count++;
 			break;
 		case 'i':
 			strncpy(s->video, optarg, 31);
 			break;
+		case 'I': {
+			char *tok = strtok(optarg, "@");
+			char *dwell = strtok(NULL, "@");
+
+			mux.dwell = 1;
+			if (dwell && WARN_ON(sscanf(dwell, "%u", &mux.dwell) != 1 ||
+					     !mux.dwell, "incorrect dwell\n"))
+				return -1;
+			for (tok = strtok(tok, ","); tok; tok = strtok(NULL, ",")) {
+				if (WARN_ON(mux.count == MAX_INPUTS,
+					    "too many inputs\n"))
+					return -1;
+				if (WARN_ON(sscanf(tok, "%u",
+						   &mux.input[mux.count]) != 1,
+					    "incorrect input\n"))
+					return -1;
+				mux.count++;
+			}
+			break;
+		}
+		case 'G': {
+			struct lessee *l = &lessor.lessee[lessor.count];
+
+			if (WARN_ON(lessor.count == MAX_LESSEES,
+				    "too many leases\n"))
+				return -1;
+			ret = sscanf(optarg, "%u:%u:%31s", &l->conId,
+				     &l->crtcId, l->video);
+			if (WARN_ON(ret != 3, "incorrect lease description\n"))
+				return -1;
+			lessor.count++;
+			break;
+		}
+		case 'k':
+			ret = sscanf(optarg, "%d", &s->lease_fd);
+			if (WARN_ON(ret != 1 || s->lease_fd < 0,
+				    "incorrect lease fd\n"))
+				return -1;
+			s->use_lease = 1;
+			break;
+		case 'V':
+			strncpy(sink.node, optarg, sizeof(sink.node) - 1);
+			break;
+		case 'Y':
+			strncpy(s->import, optarg, 31);
+			break;
+		case 'p':
+			strncpy(s->pip, optarg, 31);
+			break;
+		case 'P':
+			ret = parse_rect(optarg, &s->pip_compose);
+			if (WARN_ON(ret, "incorrect picture-in-picture area\n"))
+				return -1;
+			s->use_pip_compose = 1;
+			break;
+		case 'A':
+			ret = sscanf(optarg, "%u", &s->pip_alpha);
+			if (WARN_ON(ret != 1 || s->pip_alpha > 255,
+				    "incorrect alpha\n"))
+				return -1;
+			s->pip_alpha *= 0x101;
+			break;
+		case 'E': {
+			char *ms = strrchr(optarg, ',');
+			unsigned int tolerance = 5;
+
+			if (ms) {
+				*ms++ = 0;
+				ret = sscanf(ms, "%u", &tolerance);
+				if (WARN_ON(ret != 1, "incorrect pairing "
+					    "tolerance\n"))
+					return -1;
+			}
+			pairing.tolerance = tolerance * 1000;
+			strncpy(s->stereo, optarg, 31);
+			break;
+		}
+		case 'm':
+			strncpy(s->meta, optarg, 31);
+			break;
+		case 'R':
+			strncpy(s->media, optarg, 31);
+			break;
+		case 'C':
+			strncpy(s->control, optarg, sizeof(s->control) - 1);
+			break;
 		case 'S':
 			ret = sscanf(optarg, "%u,%u", &s->w, &s->h);
 			if (WARN_ON(ret != 2, "incorrect input size\n"))
@@ -177,11 +733,96 @@ static int parse_args(int argc, char *argv[], struct setup *s)
 				return -1;
 			s->use_compose = 1;
 			break;
+		case 'W':
+			ret = sscanf(optarg, "%ux%u,%u,%u", &s->wall_cols,
+				     &s->wall_rows, &s->bezel_h, &s->bezel_v);
+			if (WARN_ON((ret != 2 && ret != 4) || !s->wall_cols ||
+				    !s->wall_rows, "incorrect wall layout\n"))
+				return -1;
+			break;
+		case 'T':
+			ret = sscanf(optarg, "%u", &s->tile_width);
+			if (WARN_ON(ret != 1 || !s->tile_width,
+				    "incorrect plane width\n"))
+				return -1;
+			break;
 		case 'b':
 			ret = sscanf(optarg, "%u", &s->buffer_count);
 			if (WARN_ON(ret != 1, "incorrect buffer count\n"))
 				return -1;
 			break;
+		case 'B': {
+			unsigned int mib;
+
+			ret = sscanf(optarg, "%u", &mib);
+			if (WARN_ON(ret != 1 || !mib, "incorrect memory budget\n"))
+				return -1;
+			budget.limit = (uint64_t)mib << 20;
+			break;
+		}
+		case 'r':
+			ret = sscanf(optarg, "%u", &s->fps);
+			if (WARN_ON(ret != 1 || !s->fps, "incorrect frame rate\n"))
+				return -1;
+			break;
+		case 'd':
+			ret = sscanf(optarg, "%u", &s->decimate);
+			if (WARN_ON(ret != 1 || !s->decimate,
+				    "incorrect decimation\n"))
+				return -1;
+			break;
+		case 'n':
+			s->plan = 1;
+			break;
+		case 'O':
+			s->use_overlay = 1;
+			break;
+		case 'c':
+			s->use_damage = 1;
+			break;
+		case 'H':
+			ret = sscanf(optarg, "%u", &s->dedup_stride);
+			if (WARN_ON(ret != 1 || !s->dedup_stride,
+				    "incorrect hash row stride\n"))
+				return -1;
+			break;
+		case 'a':
+			s->analyze = 1;
+			break;
+		case 'v': {
+			char *every = strrchr(optarg, ',');
+
+			s->thumb_every = 30;
+			if (every) {
+				*every++ = 0;
+				ret = sscanf(every, "%u", &s->thumb_every);
+				if (WARN_ON(ret != 1 || !s->thumb_every,
+					    "incorrect preview interval\n"))
+					return -1;
+			}
+			strncpy(s->thumb, optarg, sizeof(s->thumb) - 1);
+			break;
+		}
+		case 'X':
+			s->async = 1;
+			break;
+		case 'D':
+			s->use_drift = 1;
+			break;
+		case 'q':
+			pip.priority = 1;
+			ret = sscanf(optarg, "%u,%u", &stream.priority,
+				     &pip.priority);
+			if (WARN_ON(ret < 1, "incorrect priorities\n"))
+				return -1;
+			s->use_qos = 1;
+			break;
+		case 'L':
+			strncpy(s->trace, optarg, sizeof(s->trace) - 1);
+			break;
+		case 'Q':
+			strncpy(s->replay, optarg, sizeof(s->replay) - 1);
+			break;
 		case '?':
 		case 'h':
 			usage(argv[0]);
@@ -189,10 +830,13 @@ static int parse_args(int argc, char *argv[], struct setup *s)
 		}
 	}
 
+	lessor.extra = argv + optind;
+	lessor.extra_count = argc - optind;
+
 	return 0;
 }
 
-static int buffer_create(struct buffer *b, int drmfd, struct setup *s,
+static int buffer_create(struct buffer *b, int drmfd, struct stream *st,
 	uint64_t size, uint32_t pitch)
 {
 	struct drm_mode_create_dumb gem;
@@ -200,8 +844,8 @@ static int buffer_create(struct buffer *b, int drmfd, struct setup *s,
 	int ret;
 
 	memset(&gem, 0, sizeof gem);
-	gem.width = s->w;
-	gem.height = s->h;
+	gem.width = st->w;
+	gem.height = st->h;
 	gem.bpp = 32;
 	gem.size = size;
 	ret = ioctl(drmfd, DRM_IOCTL_MODE_CREATE_DUMB, &gem);
@@ -223,9 +867,7 @@ static int buffer_create(struct buffer *b, int drmfd, struct setup *s,
 	uint32_t offsets[4] = { 0 };
 	uint32_t pitches[4] = { pitch };
 	uint32_t bo_handles[4] = { b->bo_handle };
-	unsigned int fourcc = s->out_fourcc;
-	if (!fourcc)
-		fourcc = s->in_fourcc;
+	unsigned int fourcc = st->fourcc;
 
 	fprintf(stderr, "FB fourcc %c%c%c%c\n",
 		fourcc,
@@ -233,7 +875,7 @@ static int buffer_create(struct buffer *b, int drmfd, struct setup *s,
 		fourcc >> 16,
 		fourcc >> 24);
 
-	ret = drmModeAddFB2(drmfd, s->w, s->h, fourcc, bo_handles,
+	ret = drmModeAddFB2(drmfd, st->w, st->h, fourcc, bo_handles,
 		pitches, offsets, &b->fb_handle, 0);
 	if (WARN_ON(ret, "drmModeAddFB2 failed: %s\n", ERRSTR))
 		goto fail_prime;
@@ -252,7 +894,162 @@ fail_gem:
 	return -1;
 }
 
-static int find_crtc(int drmfd, struct setup *s, uint32_t *con)
+static void import_evict(struct importer *im, unsigned int i)
+{
+	struct import_entry *e = &im->entry[i];
+	struct drm_gem_close gem_close;
+	int ret;
+
+	if (e->fb)
+		drmModeRmFB(im->fd, e->fb);
+	memset(&gem_close, 0, sizeof gem_close);
+	gem_close.handle = e->handle;
+	ret = ioctl(im->fd, DRM_IOCTL_GEM_CLOSE, &gem_close);
+	WARN_ON(ret, "import: GEM_CLOSE failed: %s\n", ERRSTR);
+
+	*e = im->entry[--im->count];
+	im->evictions++;
+}
+
+/*
+ * A freed dmabuf's inode number may be handed to a new one, so its
+ * import has to go before the fd is closed.
+ */
+static void import_forget(struct importer *im, struct buffer *b)
+{
+	struct stat sb;
+	unsigned int i;
+
+	if (im->fd < 0 || fstat(b->dbuf_fd, &sb))
+		return;
+
+	for (i = 0; i < im->count; ++i)
+		if (im->entry[i].dev == sb.st_dev &&
+		    im->entry[i].ino == sb.st_ino) {
+			import_evict(im, i);
+			break;
+		}
+}
+
+static void buffer_destroy(int drmfd, struct buffer *b)
+{
+	struct drm_mode_destroy_dumb gem_destroy;
+	int ret;
+
+	if (b->map)
+		munmap(b->map, b->size);
+	import_forget(&importer, b);
+	close(b->dbuf_fd);
+	drmModeRmFB(drmfd, b->fb_handle);
+
+	memset(&gem_destroy, 0, sizeof gem_destroy);
+	gem_destroy.handle = b->bo_handle;
+	ret = ioctl(drmfd, DRM_IOCTL_MODE_DESTROY_DUMB, &gem_destroy);
+	WARN_ON(ret, "DESTROY_DUMB failed: %s\n", ERRSTR);
+	memset(b, 0, sizeof *b);
+}
+
+static int budget_report(char *buf, size_t len)
+{
+	int n = 0;
+	unsigned int i;
+
+	for (i = 0; i < budget.count && n < (int)len; ++i) {
+		struct stream *st = budget.stream[i];
+
+		n += snprintf(buf + n, len - n, "%s %d x %.1f MiB, ",
+			      st->name, st->buffer_count,
+			      st->buffer_size / 1048576.0);
+	}
+	if (n < (int)len)
+		n += snprintf(buf + n, len - n, "total %.1f", budget.used /
+			      1048576.0);
+	if (n < (int)len && budget.limit)
+		n += snprintf(buf + n, len - n, " of %.1f",
+			      budget.limit / 1048576.0);
+	if (n < (int)len)
+		n += snprintf(buf + n, len - n, " MiB\n");
+	return n;
+}
+
+/*
+ * Gives one buffer of another pipeline back, preferring less important
+ * ones and, among equals, the largest pool. Only done while setting up,
+ * before any buffer is queued.
+ */
+static int budget_reclaim(int drmfd, struct stream *want)
+{
+	struct stream *victim = NULL;
+	struct v4l2_requestbuffers rqbufs;
+	struct buffer *b;
+	unsigned int i;
+	int ret;
+
+	for (i = 0; i < budget.count; ++i) {
+		struct stream *st = budget.stream[i];
+
+		if (st == want || st->v4lfd < 0 ||
+		    st->buffer_count <= BUDGET_MIN_BUFFERS ||
+		    st->priority < want->priority)
+			continue;
+		if (!victim || st->priority > victim->priority ||
+		    (st->priority == victim->priority &&
+		     st->buffer_count > victim->buffer_count))
+			victim = st;
+	}
+	if (!victim)
+		return -1;
+
+	b = &victim->buffer[--victim->buffer_count];
+	buffer_destroy(drmfd, b);
+	budget.used -= victim->buffer_size;
+
+	memset(&rqbufs, 0, sizeof(rqbufs));
+	rqbufs.count = victim->buffer_count;
+	rqbufs.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	rqbufs.memory = V4L2_MEMORY_DMABUF;
+	ret = ioctl(victim->v4lfd, VIDIOC_REQBUFS, &rqbufs);
+	WARN_ON(ret, "VIDIOC_REQBUFS failed: %s\n", ERRSTR);
+
+	printf("budget: took a buffer from %s for %s\n", victim->name,
+	       want->name);
+	return 0;
+}
+
+/*
+ * Creates a buffer within the memory budget. When the budget or the
+ * allocator (often a small CMA area) runs out, buffers of other pipelines
+ * are reclaimed before giving up.
+ */
+static int budget_create(int drmfd, struct stream *st, struct buffer *b,
+	uint64_t size, uint32_t pitch)
+{
+	for (;;) {
+		if (budget.limit && budget.used + size > budget.limit) {
+			if (budget_reclaim(drmfd, st))
+				return -1;
+			continue;
+		}
+		if (!buffer_create(b, drmfd, st, size, pitch))
+			break;
+		if (errno != ENOMEM || budget_reclaim(drmfd, st))
+			return -1;
+	}
+
+	budget.used += size;
+	return 0;
+}
+
+static void budget_add(struct stream *st)
+{
+	char report[256];
+
+	budget.stream[budget.count++] = st;
+	budget_report(report, sizeof report);
+	printf("budget: %s", report);
+}
+
+static int find_crtc(int drmfd, struct setup *s, struct output *out)
 {
 	int ret = -1;
 	int i;
@@ -263,7 +1060,7 @@ static int find_crtc(int drmfd, struct setup *s, uint32_t *con)
 	if (WARN_ON(res->count_crtcs <= 0, "drm: no crts\n"))
 		goto fail_res;
 
-	if (!s->conId) {
+	if (!out->conId) {
 		fprintf(stderr,
 			"No connector ID specified.  Choosing default from list:\n");
 
@@ -280,9 +1077,9 @@ static int find_crtc(int drmfd, struct setup *s, uint32_t *con)
 				}
 			}
 
-			if (!s->conId && crtc) {
-				s->conId = con->connector_id;
-				s->crtcId = crtc->crtc_id;
+			if (!out->conId && crtc) {
+				out->conId = con->connector_id;
+				out->crtcId = crtc->crtc_id;
 			}
 
 			printf("Connector %d (crtc %d): type %d, %dx%d%s\n",
@@ -291,51 +1088,61 @@ static int find_crtc(int drmfd, struct setup *s, uint32_t *con)
 			       con->connector_type,
 			       crtc ? crtc->width : 0,
 			       crtc ? crtc->height : 0,
-			       (s->conId == (int)con->connector_id ?
+			       (out->conId == (int)con->connector_id ?
 				" (chosen)" : ""));
 		}
 
-		if (!s->conId) {
+		if (!out->conId) {
 			fprintf(stderr,
 				"No suitable enabled connector found.\n");
 			exit(1);
 		}
 	}
 
-	s->crtcIdx = -1;
+	out->crtcIdx = -1;
 
 	for (i = 0; i < res->count_crtcs; ++i) {
-		if (s->crtcId == res->crtcs[i]) {
-			s->crtcIdx = i;
+		if (out->crtcId == res->crtcs[i]) {
+			out->crtcIdx = i;
 			break;
 		}
 	}
 
-	if (WARN_ON(s->crtcIdx == -1, "drm: CRTC %u not found\n", s->crtcId))
+	if (WARN_ON(out->crtcIdx == -1, "drm: CRTC %u not found\n", out->crtcId))
 		goto fail_res;
 
 	if (WARN_ON(res->count_connectors <= 0, "drm: no connectors\n"))
 		goto fail_res;
 
 	drmModeConnector *c;
-	c = drmModeGetConnector(drmfd, s->conId);
+	c = drmModeGetConnector(drmfd, out->conId);
 	if (WARN_ON(!c, "drmModeGetConnector failed: %s\n", ERRSTR))
 		goto fail_res;
 
 	if (WARN_ON(!c->count_modes, "connector supports no mode\n"))
 		goto fail_conn;
 
-	if (!s->use_compose) {
-		drmModeCrtc *crtc = drmModeGetCrtc(drmfd, s->crtcId);
-		s->compose.left = crtc->x;
-		s->compose.top = crtc->y;
-		s->compose.width = crtc->width;
-		s->compose.height = crtc->height;
-		drmModeFreeCrtc(crtc);
+	drmModeCrtc *crtc = drmModeGetCrtc(drmfd, out->crtcId);
+	if (WARN_ON(!crtc, "drmModeGetCrtc failed: %s\n", ERRSTR))
+		goto fail_conn;
+
+	if (s->use_compose) {
+		out->compose = s->compose;
+	} else {
+		out->compose.left = crtc->x;
+		out->compose.top = crtc->y;
+		out->compose.width = crtc->width;
+		out->compose.height = crtc->height;
 	}
+	if (crtc->mode_valid) {
+		out->mode = crtc->mode;
+		if (crtc->mode.vrefresh > s->vrefresh)
+			s->vrefresh = crtc->mode.vrefresh;
+	}
+	drmModeFreeCrtc(crtc);
 
-	if (con)
-		*con = c->connector_id;
+	out->shown = -1;
+	out->pending = -1;
 	ret = 0;
 
 fail_conn:
@@ -347,7 +1154,81 @@ fail_res:
 	return ret;
 }
 
-static int find_plane(int drmfd, struct setup *s)
+/* looks up a property of a KMS object, returns 0 if it is missing */
+static uint32_t get_prop(int drmfd, uint32_t obj, uint32_t type,
+	const char *name, uint64_t *value)
+{
+	drmModeObjectProperties *props;
+	uint32_t id = 0;
+	unsigned int i;
+
+	props = drmModeObjectGetProperties(drmfd, obj, type);
+	if (!props)
+		return 0;
+
+	for (i = 0; i < props->count_props && !id; ++i) {
+		drmModePropertyRes *prop = drmModeGetProperty(drmfd,
+							      props->props[i]);
+		if (!prop)
+			continue;
+		if (!strcmp(prop->name, name)) {
+			id = prop->prop_id;
+			if (value)
+				*value = props->prop_values[i];
+		}
+		drmModeFreeProperty(prop);
+	}
+
+	drmModeFreeObjectProperties(props);
+	return id;
+}
+
+static int get_plane_props(int drmfd, uint32_t plane, struct plane_props *p)
+{
+	static const struct {
+		const char *name;
+		size_t offset;
+	} names[] = {
+		{ "FB_ID", offsetof(struct plane_props, fb_id) },
+		{ "CRTC_ID", offsetof(struct plane_props, crtc_id) },
+		{ "SRC_X", offsetof(struct plane_props, src_x) },
+		{ "SRC_Y", offsetof(struct plane_props, src_y) },
+		{ "SRC_W", offsetof(struct plane_props, src_w) },
+		{ "SRC_H", offsetof(struct plane_props, src_h) },
+		{ "CRTC_X", offsetof(struct plane_props, crtc_x) },
+		{ "CRTC_Y", offsetof(struct plane_props, crtc_y) },
+		{ "CRTC_W", offsetof(struct plane_props, crtc_w) },
+		{ "CRTC_H", offsetof(struct plane_props, crtc_h) },
+	};
+	unsigned int i;
+
+	for (i = 0; i < sizeof(names) / sizeof(names[0]); ++i) {
+		uint32_t *id = (uint32_t *)((char *)p + names[i].offset);
+
+		*id = get_prop(drmfd, plane, DRM_MODE_OBJECT_PLANE,
+			       names[i].name, NULL);
+		if (WARN_ON(!*id, "plane %u has no %s property\n",
+			    plane, names[i].name))
+			return -1;
+	}
+
+	p->damage = get_prop(drmfd, plane, DRM_MODE_OBJECT_PLANE,
+			     "FB_DAMAGE_CLIPS", NULL);
+	return 0;
+}
+
+static int plane_in_use(struct setup *s, uint32_t plane_id)
+{
+	unsigned int i;
+
+	for (i = 0; i < s->out_count; ++i)
+		if (s->out[i].planeId == plane_id)
+			return 1;
+	return 0;
+}
+
+static int find_plane_type(int drmfd, struct setup *s, struct output *out,
+	uint64_t want_type)
 {
 	drmModePlaneResPtr planes;
 	drmModePlanePtr plane;
@@ -364,13 +1245,24 @@ static int find_plane(int drmfd, struct setup *s)
 		if (WARN_ON(!planes, "drmModeGetPlane failed: %s\n", ERRSTR))
 			break;
 
-		if (!(plane->possible_crtcs & (1 << s->crtcIdx))) {
+		if (!(plane->possible_crtcs & (1 << out->crtcIdx)) ||
+		    plane_in_use(s, plane->plane_id)) {
+			drmModeFreePlane(plane);
+			continue;
+		}
+
+		/* with atomic, primary and cursor planes are listed too */
+		uint64_t type = DRM_PLANE_TYPE_OVERLAY;
+		if (s->atomic)
+			get_prop(drmfd, plane->plane_id, DRM_MODE_OBJECT_PLANE,
+				 "type", &type);
+		if (type != want_type) {
 			drmModeFreePlane(plane);
 			continue;
 		}
 
 		for (j = 0; j < plane->count_formats; ++j) {
-			if (plane->formats[j] == s->out_fourcc)
+			if (plane->formats[j] == out->stream->fourcc)
 				break;
 		}
 
@@ -379,47 +1271,3974 @@ static int find_plane(int drmfd, struct setup *s)
 			continue;
 		}
 
-		s->planeId = plane->plane_id;
+		out->planeId = plane->plane_id;
 		drmModeFreePlane(plane);
 		break;
 	}
 
 	if (i == planes->count_planes)
 		ret = -1;
+	else if (s->atomic)
+		ret = get_plane_props(drmfd, out->planeId, &out->props);
 
 	drmModeFreePlaneResources(planes);
 	return ret;
 }
 
-int main(int argc, char *argv[])
+static int find_plane(int drmfd, struct setup *s, struct output *out)
+{
+	return find_plane_type(drmfd, s, out, DRM_PLANE_TYPE_OVERLAY);
+}
+
+/*
+ * Falls back to scanning frames out fullscreen on the primary plane, for
+ * display controllers without overlays. Primary planes rarely scale or
+ * leave parts of the CRTC uncovered, so outside of a video wall the frame
+ * is shown 1:1 from its top left corner and has to cover the mode. Without
+ * atomic the primary plane is not exposed and frames are flipped with
+ * drmModePageFlip.
+ */
+static int find_primary(int drmfd, struct setup *s, struct output *out)
 {
 	int ret;
-	struct setup s;
 
-	ret = parse_args(argc, argv, &s);
-	BYE_ON(ret, "failed to parse arguments\n");
-	BYE_ON(s.module[0] == 0, "DRM module is missing\n");
-	BYE_ON(s.video[0] == 0, "video node is missing\n");
+	if (WARN_ON(!out->mode.hdisplay, "crtc %u has no mode set\n",
+		    out->crtcId))
+		return -1;
 
-	int drmfd = drmOpen(s.module, NULL);
-	BYE_ON(drmfd < 0, "drmOpen(%s) failed: %s\n", s.module, ERRSTR);
+	if (WARN_ON(!s->wall_cols && (s->w < out->mode.hdisplay ||
+				      s->h < out->mode.vdisplay),
+		    "frame %ux%u is smaller than mode %ux%u, the primary "
+		    "plane cannot show it\n", s->w, s->h,
+		    out->mode.hdisplay, out->mode.vdisplay))
+		return -1;
 
-	int v4lfd = open(s.video, O_RDWR);
-	BYE_ON(v4lfd < 0, "failed to open %s: %s\n", s.video, ERRSTR);
+	if (s->atomic) {
+		ret = find_plane_type(drmfd, s, out, DRM_PLANE_TYPE_PRIMARY);
+		if (ret)
+			return -1;
+	} else {
+		out->planeId = 0;
+	}
 
-	struct v4l2_capability caps;
-	memset(&caps, 0, sizeof caps);
+	out->primary = 1;
+	out->compose.left = 0;
+	out->compose.top = 0;
+	out->compose.width = out->mode.hdisplay;
+	out->compose.height = out->mode.vdisplay;
+	if (!s->wall_cols) {
+		if (out->src_w >> 16 > out->mode.hdisplay)
+			out->src_w = out->mode.hdisplay << 16;
+		if (out->src_h >> 16 > out->mode.vdisplay)
+			out->src_h = out->mode.vdisplay << 16;
+		out->compose.width = out->src_w >> 16;
+		out->compose.height = out->src_h >> 16;
+	}
 
-	ret = ioctl(v4lfd, VIDIOC_QUERYCAP, &caps);
-	BYE_ON(ret, "VIDIOC_QUERYCAP failed: %s\n", ERRSTR);
+	printf("crtc %u: no usable overlay, using the primary plane\n",
+	       out->crtcId);
+	return 0;
+}
 
-	/* TODO: add single plane support */
-	BYE_ON(~caps.capabilities & V4L2_CAP_VIDEO_CAPTURE,
-		"video: singleplanar capture is not supported\n");
+/*
+ * Find the smallest frame size the driver offers for the current format
+ * that still covers w x h. Returns -1 if frame sizes cannot be enumerated.
+ */
+static int choose_frame_size(int v4lfd, uint32_t fourcc,
+	unsigned int *w, unsigned int *h)
+{
+	struct v4l2_frmsizeenum fsize;
+	unsigned int best_w = 0, best_h = 0;
 
-	struct v4l2_format fmt;
-	memset(&fmt, 0, sizeof fmt);
-	fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	memset(&fsize, 0, sizeof fsize);
+	fsize.pixel_format = fourcc;
+	if (ioctl(v4lfd, VIDIOC_ENUM_FRAMESIZES, &fsize))
+		return -1;
+
+	if (fsize.type != V4L2_FRMSIZE_TYPE_DISCRETE) {
+		struct v4l2_frmsize_stepwise *sw = &fsize.stepwise;
+		unsigned int step_w = sw->step_width ? sw->step_width : 1;
+		unsigned int step_h = sw->step_height ? sw->step_height : 1;
+
+		if (*w < sw->min_width)
+			*w = sw->min_width;
+		if (*h < sw->min_height)
+			*h = sw->min_height;
+		*w = sw->min_width +
+			(*w - sw->min_width + step_w - 1) / step_w * step_w;
+		*h = sw->min_height +
+			(*h - sw->min_height + step_h - 1) / step_h * step_h;
+		if (*w > sw->max_width)
+			*w = sw->max_width;
+		if (*h > sw->max_height)
+			*h = sw->max_height;
+		return 0;
+	}
+
+	do {
+		unsigned int fw = fsize.discrete.width;
+		unsigned int fh = fsize.discrete.height;
+
+		if (fw >= *w && fh >= *h &&
+		    (!best_w || (uint64_t)fw * fh < (uint64_t)best_w * best_h)) {
+			best_w = fw;
+			best_h = fh;
+		}
+		fsize.index++;
+	} while (!ioctl(v4lfd, VIDIOC_ENUM_FRAMESIZES, &fsize));
+
+	if (!best_w)
+		return -1;
+
+	*w = best_w;
+	*h = best_h;
+	return 0;
+}
+
+static void wall_canvas(struct setup *s, unsigned int *w, unsigned int *h)
+{
+	*w = s->wall_cols * s->out[0].compose.width +
+		(s->wall_cols - 1) * s->bezel_h;
+	*h = s->wall_rows * s->out[0].compose.height +
+		(s->wall_rows - 1) * s->bezel_v;
+}
+
+/* size on screen the captured frame is stretched to at most */
+static void display_coverage(struct setup *s, unsigned int *w, unsigned int *h)
+{
+	unsigned int i;
+
+	if (s->wall_cols) {
+		wall_canvas(s, w, h);
+		return;
+	}
+
+	*w = *h = 0;
+	for (i = 0; i < s->out_count; ++i) {
+		if (s->out[i].compose.width > *w)
+			*w = s->out[i].compose.width;
+		if (s->out[i].compose.height > *h)
+			*h = s->out[i].compose.height;
+	}
+}
+
+/*
+ * Split the frame between the outputs of a video wall. The frame is
+ * stretched over a canvas that includes the bezels, so each display shows
+ * the part of the canvas behind it and the hidden parts are skipped.
+ * Tiles are assumed to have the same size as the first output.
+ */
+static void wall_layout(struct setup *s)
+{
+	unsigned int canvas_w, canvas_h;
+	unsigned int i;
+
+	for (i = 0; i < s->out_count; ++i) {
+		struct output *out = &s->out[i];
+
+		out->src_x = 0;
+		out->src_y = 0;
+		out->src_w = s->w << 16;
+		out->src_h = s->h << 16;
+	}
+
+	if (!s->wall_cols)
+		return;
+
+	wall_canvas(s, &canvas_w, &canvas_h);
+
+	for (i = 0; i < s->out_count; ++i) {
+		struct output *out = &s->out[i];
+		uint64_t x = (i % s->wall_cols) *
+			(uint64_t)(s->out[0].compose.width + s->bezel_h);
+		uint64_t y = (i / s->wall_cols) *
+			(uint64_t)(s->out[0].compose.height + s->bezel_v);
+
+		out->src_x = (x * s->w << 16) / canvas_w;
+		out->src_y = (y * s->h << 16) / canvas_h;
+		out->src_w = ((uint64_t)s->out[0].compose.width * s->w << 16) /
+			canvas_w;
+		out->src_h = ((uint64_t)s->out[0].compose.height * s->h << 16) /
+			canvas_h;
+
+		printf("wall: crtc %u shows %.1fx%.1f@%.1f,%.1f\n",
+			out->crtcId, out->src_w / 65536.0, out->src_h / 65536.0,
+			out->src_x / 65536.0, out->src_y / 65536.0);
+	}
+}
+
+/*
+ * Let the capture device scale down to the compose size instead of
+ * capturing full frames for the plane to throw away.
+ */
+static void negotiate_downscale(int v4lfd, struct setup *s,
+	struct v4l2_format *fmt)
+{
+	struct v4l2_format try = *fmt;
+	unsigned int w, h;
+	int ret;
+
+	display_coverage(s, &w, &h);
+	unsigned int min_w = w, min_h = h;
+
+	if (!w || !h || (w >= fmt->fmt.pix.width && h >= fmt->fmt.pix.height))
+		return;
+
+	if (choose_frame_size(v4lfd, fmt->fmt.pix.pixelformat, &w, &h))
+		printf("video: frame sizes not enumerable, trying %ux%u\n",
+			w, h);
+
+	if (w >= fmt->fmt.pix.width && h >= fmt->fmt.pix.height)
+		return;
+
+	try.fmt.pix.width = w;
+	try.fmt.pix.height = h;
+	try.fmt.pix.bytesperline = 0;
+	try.fmt.pix.sizeimage = 0;
+	ret = ioctl(v4lfd, VIDIOC_S_FMT, &try);
+	if (WARN_ON(ret < 0, "VIDIOC_S_FMT failed: %s\n", ERRSTR))
+		return;
+
+	if (try.fmt.pix.pixelformat != fmt->fmt.pix.pixelformat ||
+	    try.fmt.pix.width < min_w || try.fmt.pix.height < min_h ||
+	    try.fmt.pix.sizeimage >= fmt->fmt.pix.sizeimage) {
+		printf("downscale: %ux%u rejected, keeping %ux%u\n",
+			try.fmt.pix.width, try.fmt.pix.height,
+			fmt->fmt.pix.width, fmt->fmt.pix.height);
+		ret = ioctl(v4lfd, VIDIOC_S_FMT, fmt);
+		WARN_ON(ret < 0, "VIDIOC_S_FMT failed: %s\n", ERRSTR);
+		return;
+	}
+
+	printf("downscale: %ux%u -> %ux%u, %u -> %u bytes per frame\n",
+		fmt->fmt.pix.width, fmt->fmt.pix.height,
+		try.fmt.pix.width, try.fmt.pix.height,
+		fmt->fmt.pix.sizeimage, try.fmt.pix.sizeimage);
+	*fmt = try;
+}
+
+/*
+ * Splits an output into two planes side by side on the same CRTC, each
+ * scanning out half of the output's source rectangle.
+ */
+static int output_split(int drmfd, struct setup *s, unsigned int idx)
+{
+	struct output *out = &s->out[idx];
+	struct output *half;
+	unsigned int src, left;
+	int ret;
+
+	if (WARN_ON(s->out_count == MAX_OUTPUTS, "too many planes\n"))
+		return -1;
+
+	memmove(out + 1, out, (s->out_count - idx) * sizeof *out);
+	s->out_count++;
+	half = out + 1;
+	half->planeId = 0;
+
+	ret = find_plane(drmfd, s, half);
+	if (WARN_ON(ret, "no free plane on crtc %u to split across\n",
+		    out->crtcId)) {
+		memmove(half, half + 1, (s->out_count - idx - 2) * sizeof *out);
+		s->out_count--;
+		return -1;
+	}
+
+	/*
+	 * Cut source and compose at the same whole source pixel, so that both
+	 * strips are scaled by the same factor.
+	 */
+	src = out->src_w >> 16;
+	left = src / 2;
+	out->src_w = left << 16;
+	half->src_x = out->src_x + out->src_w;
+	half->src_w -= out->src_w;
+
+	out->compose.width = (uint64_t)half->compose.width * left / src;
+	half->compose.left = out->compose.left + out->compose.width;
+	half->compose.width -= out->compose.width;
+
+	printf("tile: crtc %u split across planes %u and %u\n",
+		out->crtcId, out->planeId, half->planeId);
+	return 0;
+}
+
+static int widest_output(struct setup *s)
+{
+	unsigned int i;
+	int widest = 0;
+
+	for (i = 1; i < s->out_count; ++i)
+		if (s->out[i].src_w > s->out[widest].src_w)
+			widest = i;
+	return widest;
+}
+
+/* enforce a known per-plane width limit before anything is allocated */
+static int tile_to_width(int drmfd, struct setup *s)
+{
+	int i;
+
+	if (!s->tile_width)
+		return 0;
+
+	while (s->out[i = widest_output(s)].src_w >> 16 > s->tile_width)
+		if (output_split(drmfd, s, i))
+			return -1;
+	return 0;
+}
+
+/* compares frame rates of two intervals, negative if a is slower than b */
+static inline int64_t fract_rate_cmp(const struct v4l2_fract *a,
+	const struct v4l2_fract *b)
+{
+	return (int64_t)a->denominator * b->numerator -
+		(int64_t)b->denominator * a->numerator;
+}
+
+/*
+ * Pick the fastest interval the driver offers for the current format that
+ * does not exceed the target rate, falling back to the slowest one.
+ */
+static void choose_frame_interval(int v4lfd, struct v4l2_format *fmt,
+	struct v4l2_fract *tpf)
+{
+	struct v4l2_frmivalenum ival;
+	struct v4l2_fract best = { 0, 0 };
+	struct v4l2_fract slowest = { 0, 0 };
+
+	memset(&ival, 0, sizeof ival);
+	ival.pixel_format = fmt->fmt.pix.pixelformat;
+	ival.width = fmt->fmt.pix.width;
+	ival.height = fmt->fmt.pix.height;
+
+	if (ioctl(v4lfd, VIDIOC_ENUM_FRAMEINTERVALS, &ival))
+		return;
+
+	if (ival.type != V4L2_FRMIVAL_TYPE_DISCRETE) {
+		/* the driver rounds to its step in S_PARM */
+		if (fract_rate_cmp(tpf, &ival.stepwise.min) > 0)
+			*tpf = ival.stepwise.min;
+		if (fract_rate_cmp(tpf, &ival.stepwise.max) < 0)
+			*tpf = ival.stepwise.max;
+		return;
+	}
+
+	do {
+		struct v4l2_fract *f = &ival.discrete;
+
+		if (!f->numerator || !f->denominator)
+			continue;
+		if (!slowest.numerator || fract_rate_cmp(f, &slowest) < 0)
+			slowest = *f;
+		if (fract_rate_cmp(f, tpf) <= 0 &&
+		    (!best.numerator || fract_rate_cmp(f, &best) > 0))
+			best = *f;
+		ival.index++;
+	} while (!ioctl(v4lfd, VIDIOC_ENUM_FRAMEINTERVALS, &ival));
+
+	if (best.numerator)
+		*tpf = best;
+	else if (slowest.numerator)
+		*tpf = slowest;
+}
+
+static void negotiate_frame_interval(int v4lfd, struct setup *s,
+	struct v4l2_format *fmt)
+{
+	struct v4l2_streamparm parm;
+	struct v4l2_fract target;
+	int ret;
+
+	memset(&parm, 0, sizeof parm);
+	parm.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	ret = ioctl(v4lfd, VIDIOC_G_PARM, &parm);
+	if (WARN_ON(ret, "VIDIOC_G_PARM failed: %s\n", ERRSTR))
+		return;
+
+	struct v4l2_fract *tpf = &parm.parm.capture.timeperframe;
+	printf("G_PARM(start): interval = %u/%u\n",
+		tpf->numerator, tpf->denominator);
+	s->interval = *tpf;
+
+	target.numerator = s->decimate ? s->decimate : 1;
+	target.denominator = s->fps ? s->fps : s->vrefresh;
+	if (!target.denominator)
+		return;
+
+	if (parm.parm.capture.capability & V4L2_CAP_TIMEPERFRAME) {
+		*tpf = target;
+		choose_frame_interval(v4lfd, fmt, tpf);
+
+		ret = ioctl(v4lfd, VIDIOC_S_PARM, &parm);
+		WARN_ON(ret, "VIDIOC_S_PARM failed: %s\n", ERRSTR);
+
+		ret = ioctl(v4lfd, VIDIOC_G_PARM, &parm);
+		if (WARN_ON(ret, "VIDIOC_G_PARM failed: %s\n", ERRSTR))
+			return;
+		printf("G_PARM(final): interval = %u/%u (target %u/%u)\n",
+			tpf->numerator, tpf->denominator,
+			target.numerator, target.denominator);
+		s->interval = *tpf;
+	} else {
+		printf("video: frame interval is fixed\n");
+	}
+
+	/* drop frames ourselves only if the driver could not slow down */
+	if (tpf->numerator && fract_rate_cmp(tpf, &target) > 0) {
+		uint64_t n = (uint64_t)tpf->denominator * target.numerator;
+		uint64_t d = (uint64_t)tpf->numerator * target.denominator;
+
+		s->skip = (n + d / 2) / d;
+		if (s->skip > 1)
+			printf("video: keeping 1 of every %u frames\n", s->skip);
+	}
+}
+
+static void print_bytes(const char *what, double bytes, const char *suffix)
+{
+	static const char *units[] = { "B", "KiB", "MiB", "GiB" };
+	unsigned int u = 0;
+
+	while (bytes >= 1024 && u < 3) {
+		bytes /= 1024;
+		u++;
+	}
+	printf("plan: %-24s %8.1f %s%s\n", what, bytes, units[u], suffix);
+}
+
+/*
+ * Dry run: report what the negotiated configuration costs in memory and
+ * bus bandwidth without allocating buffers or touching the display.
+ */
+static void plan_print(struct setup *s, struct v4l2_format *fmt)
+{
+	double frame = fmt->fmt.pix.sizeimage;
+	double rate = 0;
+	double refresh = 0;
+	unsigned int i;
+
+	if (s->interval.numerator)
+		rate = (double)s->interval.denominator / s->interval.numerator;
+
+	printf("plan: capture %ux%u %.4s, %u bytes per frame, %.2f fps",
+		s->w, s->h, (char*)&s->in_fourcc, fmt->fmt.pix.sizeimage, rate);
+	if (s->skip > 1)
+		printf(", 1 of %u displayed", s->skip);
+	printf("\n");
+	for (i = 0; i < s->out_count; ++i) {
+		struct output *out = &s->out[i];
+
+		printf("plan: display %ux%u@%u on crtc %u, "
+			"plane %u %.4s -> %ux%u\n",
+			out->mode.hdisplay, out->mode.vdisplay,
+			out->mode.vrefresh, out->crtcId, out->planeId,
+			(char*)&s->out_fourcc,
+			out->compose.width, out->compose.height);
+		/* each plane only fetches its own source rectangle */
+		refresh += out->mode.vrefresh * ((double)out->src_w / 65536) *
+			((double)out->src_h / 65536) / ((double)s->w * s->h);
+	}
+
+	print_bytes("buffer memory", frame * s->buffer_count, "");
+	print_bytes("capture writes", frame * rate, "/s");
+	/* planes fetch their source rectangles on every refresh */
+	print_bytes("scanout reads", frame * refresh, "/s");
+	/* framebuffers wrap the capture buffers, nothing is converted */
+	print_bytes("conversion traffic", 0, "/s");
+	print_bytes("total bus traffic", frame * (rate + refresh), "/s");
+}
+
+static int meta_queue(struct meta_stream *m, unsigned int index)
+{
+	struct v4l2_buffer buf;
+	int ret;
+
+	memset(&buf, 0, sizeof buf);
+	buf.index = index;
+	buf.type = V4L2_BUF_TYPE_META_CAPTURE;
+	buf.memory = V4L2_MEMORY_MMAP;
+	ret = ioctl(m->fd, VIDIOC_QBUF, &buf);
+	if (WARN_ON(ret, "meta: VIDIOC_QBUF(index = %u) failed: %s\n",
+		    index, ERRSTR))
+		return -1;
+
+	m->buffer[index].waiting = 0;
+	return 0;
+}
+
+static int meta_setup(struct meta_stream *m, const char *node,
+	unsigned int count)
+{
+	struct v4l2_capability caps;
+	struct v4l2_format fmt;
+	struct v4l2_requestbuffers rqbufs;
+	unsigned int i;
+	int ret;
+
+	m->fd = open(node, O_RDWR | O_NONBLOCK);
+	if (WARN_ON(m->fd < 0, "failed to open %s: %s\n", node, ERRSTR))
+		return -1;
+
+	memset(&caps, 0, sizeof caps);
+	ret = ioctl(m->fd, VIDIOC_QUERYCAP, &caps);
+	if (WARN_ON(ret, "meta: VIDIOC_QUERYCAP failed: %s\n", ERRSTR))
+		return -1;
+	if (WARN_ON(~caps.device_caps & V4L2_CAP_META_CAPTURE,
+		    "%s: metadata capture is not supported\n", node))
+		return -1;
+
+	memset(&fmt, 0, sizeof fmt);
+	fmt.type = V4L2_BUF_TYPE_META_CAPTURE;
+	ret = ioctl(m->fd, VIDIOC_G_FMT, &fmt);
+	if (WARN_ON(ret, "meta: VIDIOC_G_FMT failed: %s\n", ERRSTR))
+		return -1;
+	printf("meta: 4cc = %.4s, buffersize = %u\n",
+		(char*)&fmt.fmt.meta.dataformat, fmt.fmt.meta.buffersize);
+
+	memset(&rqbufs, 0, sizeof rqbufs);
+	rqbufs.count = count;
+	rqbufs.type = V4L2_BUF_TYPE_META_CAPTURE;
+	rqbufs.memory = V4L2_MEMORY_MMAP;
+	ret = ioctl(m->fd, VIDIOC_REQBUFS, &rqbufs);
+	if (WARN_ON(ret, "meta: VIDIOC_REQBUFS failed: %s\n", ERRSTR))
+		return -1;
+
+	m->count = rqbufs.count;
+	m->buffer = calloc(m->count, sizeof *m->buffer);
+	if (WARN_ON(!m->buffer, "meta: out of memory\n"))
+		return -1;
+
+	for (i = 0; i < m->count; ++i) {
+		struct v4l2_buffer buf;
+
+		memset(&buf, 0, sizeof buf);
+		buf.index = i;
+		buf.type = V4L2_BUF_TYPE_META_CAPTURE;
+		buf.memory = V4L2_MEMORY_MMAP;
+		ret = ioctl(m->fd, VIDIOC_QUERYBUF, &buf);
+		if (WARN_ON(ret, "meta: VIDIOC_QUERYBUF failed: %s\n", ERRSTR))
+			return -1;
+
+		m->buffer[i].length = buf.length;
+		m->buffer[i].data = mmap(NULL, buf.length, PROT_READ,
+			MAP_SHARED, m->fd, buf.m.offset);
+		if (WARN_ON(m->buffer[i].data == MAP_FAILED,
+			    "meta: mmap failed: %s\n", ERRSTR))
+			return -1;
+
+		if (meta_queue(m, i))
+			return -1;
+	}
+
+	printf("meta: %u buffers ready\n", m->count);
+	return 0;
+}
+
+/*
+ * Metadata is consumed in place from the mmap()ed meta buffer; it stays
+ * valid until the video frame it belongs to is requeued.
+ */
+static void meta_deliver(struct meta_stream *m, struct buffer *b)
+{
+	struct meta_buffer *mb = &m->buffer[b->meta];
+
+	if (++m->matched % 100 == 0)
+		printf("meta: seq %u, %u bytes, %u matched, %u dropped\n",
+			mb->sequence, mb->bytesused, m->matched, m->dropped);
+}
+
+/*
+ * Pair the frame with the waiting metadata buffer of the same sequence.
+ * Waiting metadata older than the frame can no longer be matched and is
+ * given back to the driver.
+ */
+static void meta_match(struct meta_stream *m, struct buffer *b)
+{
+	unsigned int i;
+
+	for (i = 0; i < m->count; ++i) {
+		struct meta_buffer *mb = &m->buffer[i];
+
+		if (!mb->waiting)
+			continue;
+
+		if (mb->sequence == b->sequence && b->meta == -1) {
+			mb->waiting = 0;
+			b->meta = i;
+			meta_deliver(m, b);
+		} else if ((int32_t)(mb->sequence - b->sequence) < 0) {
+			m->dropped++;
+			meta_queue(m, i);
+		}
+	}
+}
+
+static int meta_dequeue(struct meta_stream *m)
+{
+	struct v4l2_buffer buf;
+	int ret;
+
+	memset(&buf, 0, sizeof buf);
+	buf.type = V4L2_BUF_TYPE_META_CAPTURE;
+	buf.memory = V4L2_MEMORY_MMAP;
+	ret = ioctl(m->fd, VIDIOC_DQBUF, &buf);
+	if (ret && errno == EAGAIN)
+		return -1;
+	BYE_ON(ret, "meta: VIDIOC_DQBUF failed: %s\n", ERRSTR);
+
+	m->buffer[buf.index].bytesused = buf.bytesused;
+	m->buffer[buf.index].sequence = buf.sequence;
+	m->buffer[buf.index].waiting = 1;
+
+	return buf.index;
+}
+
+static void meta_release(struct meta_stream *m, struct buffer *b)
+{
+	if (b->meta == -1)
+		return;
+
+	meta_queue(m, b->meta);
+	b->meta = -1;
+}
+
+static int request_setup(struct stream *st, const char *node)
+{
+	int i;
+	int ret;
+
+	st->mediafd = open(node, O_RDWR);
+	if (WARN_ON(st->mediafd < 0, "failed to open %s: %s\n", node, ERRSTR))
+		return -1;
+
+	for (i = 0; i < st->buffer_count; ++i) {
+		ret = ioctl(st->mediafd, MEDIA_IOC_REQUEST_ALLOC,
+			    &st->buffer[i].request_fd);
+		if (WARN_ON(ret, "MEDIA_IOC_REQUEST_ALLOC failed: %s\n", ERRSTR))
+			return -1;
+	}
+
+	printf("requests ready\n");
+	return 0;
+}
+
+static int ctrl_set(int fd, int request_fd, struct v4l2_ext_control *ctrls,
+	unsigned int count)
+{
+	struct v4l2_ext_controls ext;
+
+	memset(&ext, 0, sizeof ext);
+	ext.which = V4L2_CTRL_WHICH_CUR_VAL;
+	ext.count = count;
+	ext.controls = ctrls;
+	if (request_fd >= 0) {
+		ext.which = V4L2_CTRL_WHICH_REQUEST_VAL;
+		ext.request_fd = request_fd;
+	}
+
+	return ioctl(fd, VIDIOC_S_EXT_CTRLS, &ext);
+}
+
+static int video_queue(struct stream *st, unsigned int index)
+{
+	struct buffer *b = &st->buffer[index];
+	struct v4l2_buffer buf;
+	int ret;
+
+	memset(&buf, 0, sizeof buf);
+	buf.index = index;
+	buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	buf.memory = V4L2_MEMORY_DMABUF;
+	buf.m.fd = b->dbuf_fd;
+
+	b->request_ctrls = 0;
+	if (b->request_fd >= 0) {
+		if (control.pending_count) {
+			ret = ctrl_set(st->v4lfd, b->request_fd,
+				       control.pending, control.pending_count);
+			if (!WARN_ON(ret, "VIDIOC_S_EXT_CTRLS(request) failed: %s\n",
+				     ERRSTR))
+				b->request_ctrls = control.pending_count;
+			control.pending_count = 0;
+		}
+		buf.flags |= V4L2_BUF_FLAG_REQUEST_FD;
+		buf.request_fd = b->request_fd;
+	}
+
+	ret = ioctl(st->v4lfd, VIDIOC_QBUF, &buf);
+	if (WARN_ON(ret, "VIDIOC_QBUF(index = %u) failed: %s (fd %u)\n",
+		    index, ERRSTR, b->dbuf_fd))
+		return -1;
+
+	if (b->request_fd >= 0) {
+		ret = ioctl(b->request_fd, MEDIA_REQUEST_IOC_QUEUE);
+		if (WARN_ON(ret, "MEDIA_REQUEST_IOC_QUEUE failed: %s\n", ERRSTR))
+			return -1;
+	}
+
+	return 0;
+}
+
+/* the buffer is dequeued, so its request can be recycled */
+static void video_request_done(struct buffer *b)
+{
+	int ret;
+
+	if (b->request_fd < 0)
+		return;
+
+	if (b->request_ctrls)
+		printf("request: %u controls applied to frame %u\n",
+			b->request_ctrls, b->sequence);
+
+	ret = ioctl(b->request_fd, MEDIA_REQUEST_IOC_REINIT);
+	WARN_ON(ret, "MEDIA_REQUEST_IOC_REINIT failed: %s\n", ERRSTR);
+}
+
+static int control_setup(struct control *c, const char *path)
+{
+	struct sockaddr_un addr;
+	int ret;
+
+	c->fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+	if (WARN_ON(c->fd < 0, "control: socket failed: %s\n", ERRSTR))
+		return -1;
+
+	memset(&addr, 0, sizeof addr);
+	addr.sun_family = AF_UNIX;
+	snprintf(addr.sun_path, sizeof addr.sun_path, "%s", path);
+	unlink(path);
+
+	ret = bind(c->fd, (struct sockaddr *)&addr, sizeof addr);
+	if (WARN_ON(ret, "control: bind(%s) failed: %s\n", path, ERRSTR))
+		return -1;
+
+	printf("control: listening on %s\n", path);
+	return 0;
+}
+
+static int control_find(struct control *c, struct sockaddr_un *addr,
+	socklen_t len)
+{
+	unsigned int i;
+
+	for (i = 0; i < c->subscriber_count; ++i)
+		if (c->subscriber_len[i] == len &&
+		    !memcmp(&c->subscriber[i], addr, len))
+			return i;
+	return -1;
+}
+
+static int control_subscribe(struct control *c, struct sockaddr_un *addr,
+	socklen_t len)
+{
+	if (control_find(c, addr, len) >= 0)
+		return 0;
+	if (c->subscriber_count == MAX_SUBSCRIBERS)
+		return -1;
+
+	c->subscriber[c->subscriber_count] = *addr;
+	c->subscriber_len[c->subscriber_count] = len;
+	c->subscriber_count++;
+	return 0;
+}
+
+static void control_unsubscribe(struct control *c, struct sockaddr_un *addr,
+	socklen_t len)
+{
+	int i = control_find(c, addr, len);
+
+	if (i < 0)
+		return;
+	c->subscriber_count--;
+	c->subscriber[i] = c->subscriber[c->subscriber_count];
+	c->subscriber_len[i] = c->subscriber_len[c->subscriber_count];
+}
+
+/* subscribers that went away are dropped, slow ones just miss messages */
+static void control_publish(struct control *c, const char *msg)
+{
+	unsigned int i;
+	ssize_t ret;
+
+	for (i = 0; i < c->subscriber_count; ++i) {
+		ret = sendto(c->fd, msg, strlen(msg), MSG_DONTWAIT,
+			     (struct sockaddr *)&c->subscriber[i],
+			     c->subscriber_len[i]);
+		if (ret < 0 && (errno == ECONNREFUSED || errno == ENOENT)) {
+			c->subscriber_count--;
+			c->subscriber[i] = c->subscriber[c->subscriber_count];
+			c->subscriber_len[i] =
+				c->subscriber_len[c->subscriber_count];
+			i--;
+		}
+	}
+}
+
+/*
+ * Commands are single datagrams:
+ *   ctrl <id> <value>	set a V4L2 control, bound to the next queued
+ *			buffer when requests are in use
+ *   subscribe		send per-frame analysis to the sender's address
+ *   unsubscribe	stop sending it
+ *   memory		report buffer memory of every pipeline
+ */
+static void control_handle(struct control *c, struct stream *st)
+{
+	struct sockaddr_un from;
+	socklen_t fromlen;
+	char msg[256];
+	char report[256];
+	const char *reply;
+	ssize_t len;
+
+	for (;;) {
+		fromlen = sizeof from;
+		len = recvfrom(c->fd, msg, sizeof(msg) - 1, 0,
+			       (struct sockaddr *)&from, &fromlen);
+		if (len < 0)
+			break;
+		msg[len] = 0;
+
+		unsigned int id;
+		int value;
+		reply = "ok\n";
+
+		if (sscanf(msg, "ctrl %i %i", &id, &value) == 2) {
+			struct v4l2_ext_control ctrl;
+
+			memset(&ctrl, 0, sizeof ctrl);
+			ctrl.id = id;
+			ctrl.value = value;
+
+			if (st->mediafd >= 0) {
+				unsigned int i;
+
+				/* a later value replaces an unqueued one */
+				for (i = 0; i < c->pending_count; ++i)
+					if (c->pending[i].id == id)
+						break;
+				if (i < MAX_PENDING_CTRLS) {
+					c->pending[i] = ctrl;
+					if (i == c->pending_count)
+						c->pending_count++;
+				} else {
+					reply = "error: too many pending controls\n";
+				}
+			} else if (ctrl_set(st->v4lfd, -1, &ctrl, 1)) {
+				reply = "error: VIDIOC_S_EXT_CTRLS failed\n";
+			}
+		} else if (!strncmp(msg, "subscribe", 9)) {
+			if (fromlen <= sizeof(sa_family_t))
+				reply = "error: unbound address\n";
+			else if (control_subscribe(c, &from, fromlen))
+				reply = "error: too many subscribers\n";
+		} else if (!strncmp(msg, "unsubscribe", 11)) {
+			control_unsubscribe(c, &from, fromlen);
+		} else if (!strncmp(msg, "memory", 6)) {
+			budget_report(report, sizeof report);
+			reply = report;
+		} else {
+			reply = "error: unknown command\n";
+		}
+
+		if (fromlen > sizeof(sa_family_t))
+			sendto(c->fd, reply, strlen(reply), 0,
+			       (struct sockaddr *)&from, fromlen);
+	}
+}
+
+static int stream_alloc(int drmfd, struct stream *st, struct v4l2_format *fmt,
+	uint32_t fourcc, unsigned int count)
+{
+	struct v4l2_requestbuffers rqbufs;
+	unsigned int i;
+	int ret;
+
+	memset(&rqbufs, 0, sizeof(rqbufs));
+	rqbufs.count = count;
+	rqbufs.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	rqbufs.memory = V4L2_MEMORY_DMABUF;
+
+	ret = ioctl(st->v4lfd, VIDIOC_REQBUFS, &rqbufs);
+	if (WARN_ON(ret < 0, "VIDIOC_REQBUFS failed: %s\n", ERRSTR))
+		return -1;
+	if (WARN_ON(rqbufs.count < count, "video node allocated only "
+		    "%u of %u buffers\n", rqbufs.count, count))
+		return -1;
+	st->caps = rqbufs.capabilities;
+
+	st->w = fmt->fmt.pix.width;
+	st->h = fmt->fmt.pix.height;
+	st->fourcc = fourcc;
+	st->pitch = fmt->fmt.pix.bytesperline;
+	st->current_buffer = -1;
+	st->next_buffer = -1;
+	st->mediafd = -1;
+	st->meta.fd = -1;
+
+	st->buffer_count = count;
+	st->buffer = calloc(count, sizeof *st->buffer);
+	if (WARN_ON(!st->buffer, "out of memory\n"))
+		return -1;
+
+	/* TODO: add support for multiplanar formats */
+	uint32_t size = fmt->fmt.pix.sizeimage;
+	uint32_t pitch = fmt->fmt.pix.bytesperline;
+	printf("size = %u pitch = %u\n", size, pitch);
+	st->buffer_size = size;
+	for (i = 0; i < count; ++i) {
+		ret = budget_create(drmfd, st, &st->buffer[i], size, pitch);
+		if (ret)
+			break;
+		st->buffer[i].meta = -1;
+		st->buffer[i].request_fd = -1;
+	}
+
+	/* settle for fewer buffers rather than failing */
+	if (i < count) {
+		if (WARN_ON(i < BUDGET_MIN_BUFFERS, "%s: only %u buffers "
+			    "fit in memory\n", st->name, i))
+			return -1;
+		printf("%s: memory allows %u of %u buffers\n", st->name, i,
+		       count);
+		rqbufs.count = i;
+		ret = ioctl(st->v4lfd, VIDIOC_REQBUFS, &rqbufs);
+		if (WARN_ON(ret < 0, "VIDIOC_REQBUFS failed: %s\n", ERRSTR))
+			return -1;
+		st->buffer_count = i;
+	}
+	printf("buffers ready\n");
+	budget_add(st);
+
+	return 0;
+}
+
+static int stream_start(struct stream *st)
+{
+	int type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	int i;
+	int ret;
+
+	for (i = 0; i < st->buffer_count; ++i)
+		if (video_queue(st, i))
+			return -1;
+
+	ret = ioctl(st->v4lfd, VIDIOC_STREAMON, &type);
+	if (WARN_ON(ret < 0, "STREAMON failed: %s\n", ERRSTR))
+		return -1;
+
+	return 0;
+}
+
+static int video_dequeue(struct stream *st)
+{
+	struct v4l2_buffer buf;
+	int ret;
+
+	memset(&buf, 0, sizeof buf);
+	buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	buf.memory = V4L2_MEMORY_DMABUF;
+	ret = ioctl(st->v4lfd, VIDIOC_DQBUF, &buf);
+	BYE_ON(ret, "VIDIOC_DQBUF failed: %s\n", ERRSTR);
+
+	st->buffer[buf.index].sequence = buf.sequence;
+	st->buffer[buf.index].timestamp = buf.timestamp.tv_sec * 1000000ull +
+		buf.timestamp.tv_usec;
+	video_request_done(&st->buffer[buf.index]);
+
+	return buf.index;
+}
+
+/* stacks a plane above the other planes we use on its CRTC */
+static void plane_raise(int drmfd, struct setup *s, struct output *pip)
+{
+	drmModePropertyRes *prop;
+	uint64_t top = 0, z;
+	unsigned int i;
+
+	for (i = 0; i < s->out_count; ++i) {
+		struct output *out = &s->out[i];
+
+		if (out == pip || out->crtcId != pip->crtcId)
+			continue;
+		if (out->props.zpos)
+			z = out->zpos;
+		else if (!get_prop(drmfd, out->planeId, DRM_MODE_OBJECT_PLANE,
+				   "zpos", &z))
+			continue;
+		if (z > top)
+			top = z;
+	}
+
+	pip->props.zpos = get_prop(drmfd, pip->planeId, DRM_MODE_OBJECT_PLANE,
+				   "zpos", &pip->zpos);
+	if (!pip->props.zpos) {
+		printf("plane %u has no zpos, relying on plane order\n",
+			pip->planeId);
+		return;
+	}
+
+	prop = drmModeGetProperty(drmfd, pip->props.zpos);
+	if (prop && !(prop->flags & DRM_MODE_PROP_IMMUTABLE)) {
+		pip->zpos = top + 1;
+		if (prop->flags & DRM_MODE_PROP_RANGE &&
+		    prop->count_values == 2 && pip->zpos > prop->values[1])
+			pip->zpos = prop->values[1];
+	} else {
+		pip->props.zpos = 0;
+	}
+	drmModeFreeProperty(prop);
+
+	WARN_ON(pip->zpos <= top && top, "plane %u (zpos %lu) may be "
+		"hidden below video (zpos %lu)\n", pip->planeId,
+		(unsigned long)pip->zpos, (unsigned long)top);
+}
+
+static int pip_setup(int drmfd, struct setup *s, struct stream *st)
+{
+	struct v4l2_capability caps;
+	struct v4l2_format fmt;
+	struct output *out;
+	int ret;
+
+	if (WARN_ON(s->out_count == MAX_OUTPUTS, "too many planes\n"))
+		return -1;
+
+	st->v4lfd = open(s->pip, O_RDWR);
+	if (WARN_ON(st->v4lfd < 0, "failed to open %s: %s\n", s->pip, ERRSTR))
+		return -1;
+
+	memset(&caps, 0, sizeof caps);
+	ret = ioctl(st->v4lfd, VIDIOC_QUERYCAP, &caps);
+	if (WARN_ON(ret, "pip: VIDIOC_QUERYCAP failed: %s\n", ERRSTR))
+		return -1;
+	if (WARN_ON(~caps.capabilities & V4L2_CAP_VIDEO_CAPTURE,
+		    "pip: singleplanar capture is not supported\n"))
+		return -1;
+
+	out = &s->out[s->out_count];
+	*out = s->out[0];
+	out->stream = st;
+	out->planeId = 0;
+	out->shown = -1;
+	out->pending = -1;
+	if (s->use_pip_compose) {
+		out->compose = s->pip_compose;
+	} else {
+		/* quarter size in the bottom right corner */
+		out->compose.width = s->out[0].compose.width / 4;
+		out->compose.height = s->out[0].compose.height / 4;
+		out->compose.left = s->out[0].compose.left +
+			s->out[0].compose.width - out->compose.width -
+			s->out[0].compose.width / 32;
+		out->compose.top = s->out[0].compose.top +
+			s->out[0].compose.height - out->compose.height -
+			s->out[0].compose.height / 32;
+	}
+
+	/* both streams share the framebuffer format */
+	memset(&fmt, 0, sizeof fmt);
+	fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	ret = ioctl(st->v4lfd, VIDIOC_G_FMT, &fmt);
+	if (WARN_ON(ret < 0, "pip: VIDIOC_G_FMT failed: %s\n", ERRSTR))
+		return -1;
+	fmt.fmt.pix.width = out->compose.width;
+	fmt.fmt.pix.height = out->compose.height;
+	fmt.fmt.pix.pixelformat = s->in_fourcc;
+	fmt.fmt.pix.bytesperline = 0;
+	fmt.fmt.pix.sizeimage = 0;
+	ret = ioctl(st->v4lfd, VIDIOC_S_FMT, &fmt);
+	if (WARN_ON(ret < 0, "pip: VIDIOC_S_FMT failed: %s\n", ERRSTR))
+		return -1;
+	if (WARN_ON(fmt.fmt.pix.pixelformat != s->in_fourcc,
+		    "pip: format %.4s is not supported\n",
+		    (char*)&s->in_fourcc))
+		return -1;
+	printf("pip: width = %u, height = %u\n",
+		fmt.fmt.pix.width, fmt.fmt.pix.height);
+
+	ret = stream_alloc(drmfd, st, &fmt, s->out_fourcc, s->buffer_count);
+	if (ret)
+		return -1;
+
+	out->src_x = 0;
+	out->src_y = 0;
+	out->src_w = st->w << 16;
+	out->src_h = st->h << 16;
+
+	ret = find_plane(drmfd, s, out);
+	if (WARN_ON(ret, "pip: no free plane on crtc %u\n", out->crtcId))
+		return -1;
+	s->out_count++;
+
+	plane_raise(drmfd, s, out);
+	out->props.alpha = get_prop(drmfd, out->planeId,
+				    DRM_MODE_OBJECT_PLANE, "alpha", NULL);
+	out->alpha = s->pip_alpha;
+	WARN_ON(!out->props.alpha && s->pip_alpha != 0xffff,
+		"pip: plane %u has no alpha property\n", out->planeId);
+
+	return 0;
+}
+
+static uint64_t now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000ull + ts.tv_nsec / 1000;
+}
+
+static void stats_capture(struct buffer *b)
+{
+	if (stats.trace)
+		fprintf(stats.trace, "c %u %llu %llu\n", b->sequence,
+			(unsigned long long)b->timestamp,
+			(unsigned long long)now_us());
+
+	if (stats.frames_captured++ &&
+	    b->sequence - stats.last_sequence > 1)
+		stats.drops += b->sequence - stats.last_sequence - 1;
+	stats.last_sequence = b->sequence;
+}
+
+static void stats_flip(struct buffer *b, uint64_t flip_time)
+{
+	if (stats.trace)
+		fprintf(stats.trace, "f %llu %llu\n",
+			(unsigned long long)flip_time,
+			(unsigned long long)b->timestamp);
+
+	stats.frames_shown++;
+	if (stats.latency_count < MAX_LATENCY_SAMPLES && flip_time > b->timestamp)
+		stats.latency[stats.latency_count++] = flip_time - b->timestamp;
+}
+
+static int cmp_u32(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* of sorted microsecond samples, in milliseconds */
+static double percentile(uint32_t *v, unsigned int count, unsigned int pct)
+{
+	if (!count)
+		return 0;
+	return v[(count - 1) * pct / 100] / 1000.0;
+}
+
+static double stats_percentile(unsigned int pct)
+{
+	return percentile(stats.latency, stats.latency_count, pct);
+}
+
+/* 5x7 glyphs for the characters the overlay prints */
+static const struct {
+	char c;
+	uint8_t rows[7];
+} font[] = {
+	{ '0', { 0x0e, 0x11, 0x13, 0x15, 0x19, 0x11, 0x0e } },
+	{ '1', { 0x04, 0x0c, 0x04, 0x04, 0x04, 0x04, 0x0e } },
+	{ '2', { 0x0e, 0x11, 0x01, 0x02, 0x04, 0x08, 0x1f } },
+	{ '3', { 0x1f, 0x02, 0x04, 0x02, 0x01, 0x11, 0x0e } },
+	{ '4', { 0x02, 0x06, 0x0a, 0x12, 0x1f, 0x02, 0x02 } },
+	{ '5', { 0x1f, 0x10, 0x1e, 0x01, 0x01, 0x11, 0x0e } },
+	{ '6', { 0x06, 0x08, 0x10, 0x1e, 0x11, 0x11, 0x0e } },
+	{ '7', { 0x1f, 0x01, 0x02, 0x04, 0x08, 0x08, 0x08 } },
+	{ '8', { 0x0e, 0x11, 0x11, 0x0e, 0x11, 0x11, 0x0e } },
+	{ '9', { 0x0e, 0x11, 0x11, 0x0f, 0x01, 0x02, 0x0c } },
+	{ '.', { 0x00, 0x00, 0x00, 0x00, 0x00, 0x0c, 0x0c } },
+	{ '/', { 0x01, 0x01, 0x02, 0x04, 0x08, 0x10, 0x10 } },
+	{ 'A', { 0x0e, 0x11, 0x11, 0x1f, 0x11, 0x11, 0x11 } },
+	{ 'D', { 0x1c, 0x12, 0x11, 0x11, 0x11, 0x12, 0x1c } },
+	{ 'F', { 0x1f, 0x10, 0x10, 0x1e, 0x10, 0x10, 0x10 } },
+	{ 'L', { 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x1f } },
+	{ 'M', { 0x11, 0x1b, 0x15, 0x15, 0x11, 0x11, 0x11 } },
+	{ 'O', { 0x0e, 0x11, 0x11, 0x11, 0x11, 0x11, 0x0e } },
+	{ 'P', { 0x1e, 0x11, 0x11, 0x1e, 0x10, 0x10, 0x10 } },
+	{ 'R', { 0x1e, 0x11, 0x11, 0x1e, 0x14, 0x12, 0x11 } },
+	{ 'S', { 0x0f, 0x10, 0x10, 0x0e, 0x01, 0x01, 0x1e } },
+	{ 'T', { 0x1f, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04 } },
+	{ 'Y', { 0x11, 0x11, 0x0a, 0x04, 0x04, 0x04, 0x04 } },
+};
+
+static void overlay_text(struct stream *st, struct buffer *b,
+	unsigned int x, unsigned int y, unsigned int scale, const char *str)
+{
+	uint32_t *pixels = b->map;
+	unsigned int i, row, col;
+
+	for (; *str; str++, x += 6 * scale) {
+		for (i = 0; i < sizeof(font) / sizeof(font[0]); ++i)
+			if (font[i].c == *str)
+				break;
+		if (i == sizeof(font) / sizeof(font[0]))
+			continue;
+
+		for (row = 0; row < 7 * scale; ++row) {
+			for (col = 0; col < 5 * scale; ++col) {
+				unsigned int px = x + col, py = y + row;
+
+				if (px >= st->w || py >= st->h)
+					continue;
+				if (font[i].rows[row / scale] &
+				    (0x10 >> (col / scale)))
+					pixels[py * st->w + px] = 0xffffffff;
+			}
+		}
+	}
+}
+
+static int buffer_map(int drmfd, struct buffer *b, size_t size)
+{
+	struct drm_mode_map_dumb map;
+	int ret;
+
+	memset(&map, 0, sizeof map);
+	map.handle = b->bo_handle;
+	ret = ioctl(drmfd, DRM_IOCTL_MODE_MAP_DUMB, &map);
+	if (WARN_ON(ret, "MAP_DUMB failed: %s\n", ERRSTR))
+		return -1;
+
+	b->map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, drmfd,
+		      map.offset);
+	if (WARN_ON(b->map == MAP_FAILED, "mmap failed: %s\n", ERRSTR)) {
+		b->map = NULL;
+		return -1;
+	}
+	b->size = size;
+
+	return 0;
+}
+
+/*
+ * The overlay is a stream of two ARGB buffers we draw ourselves, shown on
+ * an overlay plane or, failing that, the cursor plane of the first output.
+ */
+static int overlay_setup(int drmfd, struct setup *s, struct stream *st)
+{
+	struct output *out;
+	uint64_t cursor_w = 0, cursor_h = 0;
+	int i;
+	int ret;
+
+	if (WARN_ON(s->out_count == MAX_OUTPUTS, "too many planes\n"))
+		return -1;
+
+	st->v4lfd = -1;
+	st->w = 256;
+	st->h = 80;
+	st->fourcc = DRM_FORMAT_ARGB8888;
+	st->current_buffer = -1;
+	st->next_buffer = -1;
+	st->mediafd = -1;
+	st->meta.fd = -1;
+
+	out = &s->out[s->out_count];
+	*out = s->out[0];
+	out->stream = st;
+	out->planeId = 0;
+	out->shown = -1;
+	out->pending = -1;
+	out->props.zpos = 0;
+	out->props.alpha = 0;
+
+	ret = find_plane(drmfd, s, out);
+	if (ret) {
+		ret = find_plane_type(drmfd, s, out, DRM_PLANE_TYPE_CURSOR);
+		if (WARN_ON(ret, "overlay: no free plane on crtc %u\n",
+			    out->crtcId))
+			return -1;
+
+		/* cursor planes do not scale and are limited in size */
+		drmGetCap(drmfd, DRM_CAP_CURSOR_WIDTH, &cursor_w);
+		drmGetCap(drmfd, DRM_CAP_CURSOR_HEIGHT, &cursor_h);
+		if (cursor_w && cursor_w < st->w)
+			st->w = cursor_w;
+		if (cursor_h && cursor_h < st->h)
+			st->h = cursor_h;
+	}
+	st->pitch = st->w * 4;
+	st->buffer_size = st->pitch * st->h;
+
+	st->buffer_count = 2;
+	st->buffer = calloc(st->buffer_count, sizeof *st->buffer);
+	if (WARN_ON(!st->buffer, "out of memory\n"))
+		return -1;
+
+	for (i = 0; i < st->buffer_count; ++i) {
+		struct buffer *b = &st->buffer[i];
+
+		ret = budget_create(drmfd, st, b, st->buffer_size, st->pitch);
+		if (ret || buffer_map(drmfd, b, st->buffer_size))
+			return -1;
+		b->meta = -1;
+		b->request_fd = -1;
+		memset(b->map, 0, b->size);
+	}
+	budget_add(st);
+
+	out->src_x = 0;
+	out->src_y = 0;
+	out->src_w = st->w << 16;
+	out->src_h = st->h << 16;
+	out->compose.left = s->out[0].compose.left + 8;
+	out->compose.top = s->out[0].compose.top + 8;
+	out->compose.width = st->w;
+	out->compose.height = st->h;
+	s->out_count++;
+
+	plane_raise(drmfd, s, out);
+	printf("overlay: %ux%u on plane %u\n", st->w, st->h, out->planeId);
+
+	stats.since = now_us();
+	return 0;
+}
+
+static void buffer_sync(struct buffer *b, uint64_t flags)
+{
+	struct dma_buf_sync sync = { .flags = flags };
+	int ret;
+
+	ret = ioctl(b->dbuf_fd, DMA_BUF_IOCTL_SYNC, &sync);
+	WARN_ON(ret, "DMA_BUF_IOCTL_SYNC failed: %s\n", ERRSTR);
+}
+
+typedef uint8_t v16u8 __attribute__((vector_size(16)));
+
+/* the compiler turns this into SSE2/NEON loads, xors and ors */
+static int span_differs(const uint8_t *a, const uint8_t *b, size_t len)
+{
+	v16u8 acc = { 0 };
+	uint64_t r[2];
+	size_t i;
+
+	for (i = 0; i + 64 <= len; i += 64) {
+		v16u8 a0, a1, a2, a3, b0, b1, b2, b3;
+
+		memcpy(&a0, a + i, 16);
+		memcpy(&a1, a + i + 16, 16);
+		memcpy(&a2, a + i + 32, 16);
+		memcpy(&a3, a + i + 48, 16);
+		memcpy(&b0, b + i, 16);
+		memcpy(&b1, b + i + 16, 16);
+		memcpy(&b2, b + i + 32, 16);
+		memcpy(&b3, b + i + 48, 16);
+		acc |= (a0 ^ b0) | (a1 ^ b1) | (a2 ^ b2) | (a3 ^ b3);
+	}
+	for (; i + 16 <= len; i += 16) {
+		v16u8 va, vb;
+
+		memcpy(&va, a + i, 16);
+		memcpy(&vb, b + i, 16);
+		acc |= va ^ vb;
+	}
+
+	memcpy(r, &acc, sizeof r);
+	if (r[0] | r[1])
+		return 1;
+
+	for (; i < len; ++i)
+		if (a[i] != b[i])
+			return 1;
+	return 0;
+}
+
+/*
+ * Compares two frames in tiles and collects the changed tiles as one
+ * rectangle per row of tiles, merging rows that span the same columns.
+ * Only the first plane is compared, which is luma for planar formats.
+ */
+static unsigned int damage_compute(struct stream *st, struct buffer *cur,
+	struct buffer *prev, struct damage *d)
+{
+	unsigned int cpp = st->pitch / st->w ? st->pitch / st->w : 1;
+	unsigned int tiles_x = (st->w + DAMAGE_TILE_W - 1) / DAMAGE_TILE_W;
+	unsigned int tx, y, row;
+
+	d->count = 0;
+	d->area = 0;
+
+	buffer_sync(cur, DMA_BUF_SYNC_START | DMA_BUF_SYNC_READ);
+	buffer_sync(prev, DMA_BUF_SYNC_START | DMA_BUF_SYNC_READ);
+
+	for (y = 0; y < st->h; y += DAMAGE_TILE_H) {
+		unsigned int rows = st->h - y < DAMAGE_TILE_H ?
+			st->h - y : DAMAGE_TILE_H;
+		int x1 = -1, x2 = -1;
+
+		for (tx = 0; tx < tiles_x; ++tx) {
+			unsigned int x = tx * DAMAGE_TILE_W;
+			unsigned int w = st->w - x < DAMAGE_TILE_W ?
+				st->w - x : DAMAGE_TILE_W;
+
+			for (row = 0; row < rows; ++row) {
+				size_t off = (size_t)(y + row) * st->pitch +
+					x * cpp;
+
+				if (span_differs((uint8_t *)cur->map + off,
+						 (uint8_t *)prev->map + off,
+						 w * cpp))
+					break;
+			}
+			if (row == rows)
+				continue;
+			if (x1 == -1)
+				x1 = x;
+			x2 = x + w;
+		}
+
+		if (x1 == -1)
+			continue;
+
+		d->area += (x2 - x1) * rows;
+
+		struct drm_mode_rect *last = d->count ?
+			&d->rects[d->count - 1] : NULL;
+		if (last && last->x1 == x1 && last->x2 == x2 &&
+		    last->y2 == (int)y) {
+			last->y2 = y + rows;
+		} else if (d->count < MAX_DAMAGE_CLIPS) {
+			d->rects[d->count++] = (struct drm_mode_rect) {
+				x1, y, x2, y + rows };
+		} else {
+			/* too many clips, grow the last one to cover it */
+			if (x1 < last->x1)
+				last->x1 = x1;
+			if (x2 > last->x2)
+				last->x2 = x2;
+			last->y2 = y + rows;
+		}
+	}
+
+	buffer_sync(prev, DMA_BUF_SYNC_END | DMA_BUF_SYNC_READ);
+	buffer_sync(cur, DMA_BUF_SYNC_END | DMA_BUF_SYNC_READ);
+
+	return d->count;
+}
+
+/* four independent multiply-xor lanes keep the multipliers busy */
+static uint64_t hash_span(const uint8_t *p, size_t len, uint64_t h)
+{
+	const uint64_t k = 0x9e3779b97f4a7c15ull;
+	uint64_t h0 = h, h1 = h ^ k, h2 = h + k, h3 = ~h;
+	uint64_t w[4];
+	size_t i;
+
+	for (i = 0; i + 32 <= len; i += 32) {
+		memcpy(w, p + i, sizeof w);
+		h0 = (h0 ^ w[0]) * k;
+		h1 = (h1 ^ w[1]) * k;
+		h2 = (h2 ^ w[2]) * k;
+		h3 = (h3 ^ w[3]) * k;
+	}
+	h = h0 ^ (h1 << 17 | h1 >> 47) ^ (h2 << 31 | h2 >> 33) ^
+		(h3 << 47 | h3 >> 17);
+	for (; i < len; ++i)
+		h = (h ^ p[i]) * k;
+
+	return h ^ h >> 29;
+}
+
+/* hashes every n-th row of the first plane */
+static uint64_t frame_hash(struct stream *st, struct buffer *b,
+	unsigned int stride)
+{
+	uint64_t h = 0;
+	unsigned int y;
+
+	buffer_sync(b, DMA_BUF_SYNC_START | DMA_BUF_SYNC_READ);
+	for (y = 0; y < st->h; y += stride)
+		h = hash_span((uint8_t *)b->map + (size_t)y * st->pitch,
+			      st->pitch, h + y);
+	buffer_sync(b, DMA_BUF_SYNC_END | DMA_BUF_SYNC_READ);
+
+	return h;
+}
+
+/*
+ * Returns 1 if the frame is identical to the last one sent to the
+ * display, in which case it has been given back to the driver already.
+ */
+static int frame_dedup(struct setup *s, struct stream *st, int index)
+{
+	uint64_t h;
+	int ret;
+
+	if (!s->dedup_stride || st->qos_level)
+		return 0;
+
+	if (++stats.hashed % 300 == 0) {
+		printf("dedup: %u of the last 300 frames identical\n",
+			stats.deduplicated);
+		stats.deduplicated = 0;
+	}
+
+	h = frame_hash(st, &st->buffer[index], s->dedup_stride);
+	if (st->last_hash_valid && h == st->last_hash) {
+		stats.deduplicated++;
+		ret = video_queue(st, index);
+		BYE_ON(ret, "failed to requeue buffer %d\n", index);
+		return 1;
+	}
+
+	st->last_hash = h;
+	st->last_hash_valid = 1;
+	return 0;
+}
+
+static void fit_reset(struct clock_fit *f)
+{
+	memset(f, 0, sizeof *f);
+}
+
+/*
+ * Least squares fit of timestamps against frame or vblank counters, so
+ * missed counts do not matter and timestamp jitter averages out.
+ */
+static void fit_add(struct clock_fit *f, uint32_t count, uint64_t time)
+{
+	double x, y;
+
+	if (!f->n) {
+		f->count0 = count;
+		f->time0 = time;
+	}
+	x = (uint32_t)(count - f->count0);
+	y = (double)(time - f->time0);
+
+	f->n++;
+	f->sx += x;
+	f->sy += y;
+	f->sxx += x * x;
+	f->sxy += x * y;
+}
+
+/* period in microseconds, 0 without enough samples */
+static double fit_period(struct clock_fit *f)
+{
+	double d = f->n * f->sxx - f->sx * f->sx;
+
+	if (f->n < DRIFT_MIN_SAMPLES || d <= 0)
+		return 0;
+	return (f->n * f->sxy - f->sx * f->sy) / d;
+}
+
+/*
+ * Nudges the capture interval to a whole number of refresh periods. Only
+ * drivers taking fine grained intervals can follow this, the others
+ * report back the interval they already had.
+ */
+static int drift_adjust(int v4lfd, struct drift *d, double period)
+{
+	struct v4l2_streamparm parm;
+	struct v4l2_fract *tpf = &parm.parm.capture.timeperframe;
+	struct v4l2_fract old;
+	int ret;
+
+	memset(&parm, 0, sizeof parm);
+	parm.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	ret = ioctl(v4lfd, VIDIOC_G_PARM, &parm);
+	if (WARN_ON(ret, "VIDIOC_G_PARM failed: %s\n", ERRSTR))
+		return -1;
+	if (!(parm.parm.capture.capability & V4L2_CAP_TIMEPERFRAME))
+		return -1;
+
+	old = *tpf;
+	tpf->numerator = llround(period * 1000);
+	tpf->denominator = 1000000000;
+	ret = ioctl(v4lfd, VIDIOC_S_PARM, &parm);
+	if (WARN_ON(ret, "VIDIOC_S_PARM failed: %s\n", ERRSTR))
+		return -1;
+
+	if ((uint64_t)tpf->numerator * old.denominator ==
+	    (uint64_t)old.numerator * tpf->denominator)
+		return -1;
+
+	printf("drift: capture interval %u/%u -> %u/%u\n", old.numerator,
+	       old.denominator, tpf->numerator, tpf->denominator);
+	d->adjustments++;
+	return 0;
+}
+
+/*
+ * Compares the capture and refresh periods once per window. When the
+ * camera runs at a whole multiple of the refresh period, any difference
+ * shows up as a repeated or dropped frame every 1 / (rate * ppm) seconds.
+ */
+static void drift_update(struct setup *s, struct drift *d, int v4lfd)
+{
+	double capture, vblank, ratio, target;
+	unsigned int n;
+	uint64_t now = now_us();
+
+	if (!d->since)
+		d->since = now;
+	if (now - d->since < DRIFT_WINDOW_US)
+		return;
+	d->since = now;
+
+	capture = fit_period(&d->capture);
+	vblank = fit_period(&d->vblank);
+	fit_reset(&d->capture);
+	fit_reset(&d->vblank);
+	if (!capture || !vblank)
+		return;
+
+	/* only frames that are shown count against the refresh */
+	ratio = capture * (s->skip > 1 ? s->skip : 1) / vblank;
+	n = lround(ratio);
+	if (!n || fabs(ratio - n) > 0.01 * n) {
+		printf("drift: capture %.3f ms is no multiple of refresh "
+		       "%.3f ms\n", capture / 1000, vblank / 1000);
+		return;
+	}
+
+	d->ppm = (ratio / n - 1) * 1e6;
+	printf("drift: capture %.4f ms, refresh %.4f ms, %+.0f ppm",
+	       capture / 1000, vblank / 1000, d->ppm);
+	if (fabs(d->ppm) > 1)
+		printf(", a frame %s every %.1f s", d->ppm > 0 ?
+		       "repeats" : "drops", n * vblank / fabs(d->ppm));
+	printf("\n");
+
+	if (d->fixed || fabs(d->ppm) < DRIFT_TOLERANCE_PPM)
+		return;
+
+	target = vblank * n / (s->skip > 1 ? s->skip : 1);
+	if (d->adjustments >= DRIFT_MAX_ADJUSTMENTS ||
+	    drift_adjust(v4lfd, d, target)) {
+		printf("drift: frame interval cannot be tuned, not "
+		       "compensating\n");
+		d->fixed = 1;
+	}
+}
+
+/* gives a buffer no longer used by the display back to the driver */
+static void buffer_release(struct stream *st, int index)
+{
+	int ret;
+
+	if (st->current_buffer == index)
+		st->current_buffer = -1;
+
+	/* views of a multiplexed stream return buffers through it */
+	if (st->source)
+		st = st->source;
+
+	/* drawn by us, nothing to give back */
+	if (st->v4lfd < 0)
+		return;
+
+	meta_release(&st->meta, &st->buffer[index]);
+	ret = video_queue(st, index);
+	BYE_ON(ret, "failed to requeue buffer %d\n", index);
+}
+
+static void buffer_unref(struct stream *st, int index)
+{
+	if (index != -1 && --st->buffer[index].refs == 0)
+		buffer_release(st, index);
+}
+
+/* a new commit has to wait until every CRTC flipped to the last one */
+static int display_busy(struct setup *s)
+{
+	unsigned int i;
+
+	for (i = 0; i < s->out_count; ++i)
+		if (s->out[i].pending != -1)
+			return 1;
+	return 0;
+}
+
+static void display_fill(drmModeAtomicReq *req, struct output *out,
+	struct buffer *b)
+{
+	struct plane_props *p = &out->props;
+
+	drmModeAtomicAddProperty(req, out->planeId, p->fb_id, b->fb_handle);
+	drmModeAtomicAddProperty(req, out->planeId, p->crtc_id, out->crtcId);
+	drmModeAtomicAddProperty(req, out->planeId, p->src_x, out->src_x);
+	drmModeAtomicAddProperty(req, out->planeId, p->src_y, out->src_y);
+	drmModeAtomicAddProperty(req, out->planeId, p->src_w, out->src_w);
+	drmModeAtomicAddProperty(req, out->planeId, p->src_h, out->src_h);
+	drmModeAtomicAddProperty(req, out->planeId, p->crtc_x,
+				 out->compose.left);
+	drmModeAtomicAddProperty(req, out->planeId, p->crtc_y,
+				 out->compose.top);
+	drmModeAtomicAddProperty(req, out->planeId, p->crtc_w,
+				 out->compose.width);
+	drmModeAtomicAddProperty(req, out->planeId, p->crtc_h,
+				 out->compose.height);
+	if (p->zpos)
+		drmModeAtomicAddProperty(req, out->planeId, p->zpos, out->zpos);
+	if (p->alpha)
+		drmModeAtomicAddProperty(req, out->planeId, p->alpha,
+					 out->alpha);
+}
+
+static int display_test(int drmfd, struct setup *s)
+{
+	drmModeAtomicReq *req;
+	unsigned int i;
+	int ret;
+
+	req = drmModeAtomicAlloc();
+	if (WARN_ON(!req, "drmModeAtomicAlloc failed\n"))
+		return -1;
+
+	for (i = 0; i < s->out_count; ++i)
+		display_fill(req, &s->out[i], &s->out[i].stream->buffer[0]);
+	ret = drmModeAtomicCommit(drmfd, req, DRM_MODE_ATOMIC_TEST_ONLY, NULL);
+	drmModeAtomicFree(req);
+
+	return ret;
+}
+
+/*
+ * Planes may be limited to a narrower width than the frame. Without -T the
+ * limit is unknown, so the widest plane is split while the driver rejects
+ * the configuration, but never into strips narrower than TILE_MIN_WIDTH.
+ * A rejection that splitting does not cure is reported with the original
+ * layout, it is about something else than the width.
+ */
+static int tile_outputs(int drmfd, struct setup *s)
+{
+	struct output saved[MAX_OUTPUTS];
+	unsigned int count = s->out_count;
+	int err;
+
+	if (!display_test(drmfd, s))
+		return 0;
+	err = errno;
+
+	memcpy(saved, s->out, sizeof saved);
+	/* with -T the planes are already as narrow as the known limit */
+	while (!s->tile_width &&
+	       s->out[widest_output(s)].src_w >> 16 > TILE_MIN_WIDTH) {
+		if (output_split(drmfd, s, widest_output(s)))
+			break;
+		if (!display_test(drmfd, s))
+			return 0;
+	}
+
+	memcpy(s->out, saved, sizeof saved);
+	s->out_count = count;
+	WARN_ON(1, "display rejected the plane configuration: %s\n",
+		strerror(err));
+	return -1;
+}
+
+/*
+ * The legacy path cannot test a plane configuration, so a frame too wide
+ * for one plane would only fail on the first SetPlane. If the driver does
+ * atomic, the single plane layout is tested once and the atomic path is
+ * kept to split it when the driver rejects it. Returns 1 in that case.
+ */
+static int atomic_probe(int drmfd, struct setup *s)
+{
+	struct output *out = &s->out[0];
+
+	if (drmSetClientCap(drmfd, DRM_CLIENT_CAP_ATOMIC, 1))
+		return 0;
+
+	s->atomic = 1;
+	if (!get_plane_props(drmfd, out->planeId, &out->props) &&
+	    display_test(drmfd, s)) {
+		printf("tile: plane %u rejected, switching to atomic\n",
+		       out->planeId);
+		return 1;
+	}
+
+	s->atomic = 0;
+	drmSetClientCap(drmfd, DRM_CLIENT_CAP_ATOMIC, 0);
+	return 0;
+}
+
+/*
+ * Compares the next frame with the one on screen. Unchanged frames are
+ * dropped without a commit, otherwise returns a blob with the changed
+ * regions, or 0 if there is none.
+ */
+static uint32_t display_damage(int drmfd, struct setup *s)
+{
+	struct damage damage;
+	uint32_t blob = 0;
+	int prev = s->out[0].shown;
+	int ret;
+
+	if (!s->use_damage || stream.next_buffer == -1 || prev == -1 ||
+	    stream.qos_level)
+		return 0;
+
+	if (++stats.commits % 300 == 0) {
+		printf("damage: %u of the last 300 frames unchanged\n",
+			stats.unchanged);
+		stats.unchanged = 0;
+	}
+
+	if (!damage_compute(&stream, &stream.buffer[stream.next_buffer],
+			    &stream.buffer[prev], &damage)) {
+		buffer_unref(&stream, stream.next_buffer);
+		stream.next_buffer = -1;
+		stats.unchanged++;
+		return 0;
+	}
+
+	ret = drmModeCreatePropertyBlob(drmfd, damage.rects,
+					damage.count * sizeof damage.rects[0],
+					&blob);
+	WARN_ON(ret, "drmModeCreatePropertyBlob failed: %s\n", ERRSTR);
+
+	return ret ? 0 : blob;
+}
+
+/*
+ * Legacy primary plane path: the first frame replaces whatever the CRTC
+ * scanned out, later ones are page flips completed by the flip event.
+ */
+static int display_flip(int drmfd, struct setup *s)
+{
+	struct output *out = &s->out[0];
+	struct stream *st = out->stream;
+	int index = st->next_buffer;
+	uint32_t con = out->conId;
+	int ret;
+
+	if (index == -1)
+		return 0;
+
+	if (out->shown == -1) {
+		ret = drmModeSetCrtc(drmfd, out->crtcId,
+				     st->buffer[index].fb_handle,
+				     out->src_x >> 16, out->src_y >> 16,
+				     &con, 1, &out->mode);
+		if (WARN_ON(ret, "drmModeSetCrtc failed: %s\n", ERRSTR))
+			return -1;
+		stats_flip(&st->buffer[index], now_us());
+		out->shown = index;
+	} else {
+		ret = drmModePageFlip(drmfd, out->crtcId,
+				      st->buffer[index].fb_handle,
+				      DRM_MODE_PAGE_FLIP_EVENT |
+				      (s->async ? DRM_MODE_PAGE_FLIP_ASYNC : 0),
+				      s);
+		if (ret && s->async) {
+			WARN_ON(1, "async flip failed, waiting for vblank: %s\n",
+				ERRSTR);
+			s->async = 0;
+			return display_flip(drmfd, s);
+		}
+		if (WARN_ON(ret, "drmModePageFlip failed: %s\n", ERRSTR))
+			return -1;
+		out->pending = index;
+	}
+
+	/* the output took over the reference held while waiting */
+	st->next_buffer = -1;
+	return 0;
+}
+
+/* commits the newest waiting frame of every stream in one go */
+static int display_commit(int drmfd, struct setup *s)
+{
+	drmModeAtomicReq *req;
+	struct buffer *b;
+	unsigned int count = 0;
+	uint32_t damage;
+	unsigned int i;
+	int ret;
+
+	if (!s->atomic)
+		return display_flip(drmfd, s);
+
+	damage = display_damage(drmfd, s);
+
+	req = drmModeAtomicAlloc();
+	if (WARN_ON(!req, "drmModeAtomicAlloc failed\n"))
+		return -1;
+
+	for (i = 0; i < s->out_count; ++i) {
+		struct output *out = &s->out[i];
+
+		if (out->stream->next_buffer == -1)
+			continue;
+		b = &out->stream->buffer[out->stream->next_buffer];
+		/* async flips may change nothing but the framebuffer */
+		if (s->async && out->shown != -1)
+			drmModeAtomicAddProperty(req, out->planeId,
+						 out->props.fb_id, b->fb_handle);
+		else
+			display_fill(req, out, b);
+		if (damage && !s->async && out->stream == &stream &&
+		    out->props.damage)
+			drmModeAtomicAddProperty(req, out->planeId,
+						 out->props.damage, damage);
+		count++;
+	}
+
+	if (!count) {
+		drmModeAtomicFree(req);
+		return 0;
+	}
+
+	ret = drmModeAtomicCommit(drmfd, req, DRM_MODE_ATOMIC_NONBLOCK |
+				  DRM_MODE_PAGE_FLIP_EVENT |
+				  (s->async ? DRM_MODE_PAGE_FLIP_ASYNC : 0), s);
+	drmModeAtomicFree(req);
+	if (damage)
+		drmModeDestroyPropertyBlob(drmfd, damage);
+	if (ret && s->async) {
+		WARN_ON(1, "async commit failed, waiting for vblank: %s\n",
+			ERRSTR);
+		s->async = 0;
+		return display_commit(drmfd, s);
+	}
+	if (WARN_ON(ret, "drmModeAtomicCommit failed: %s\n", ERRSTR))
+		return -1;
+	if (stats.trace)
+		fprintf(stats.trace, "m %llu\n", (unsigned long long)now_us());
+
+	for (i = 0; i < s->out_count; ++i) {
+		struct output *out = &s->out[i];
+		int index = out->stream->next_buffer;
+
+		if (index == -1)
+			continue;
+		out->pending = index;
+		out->stream->buffer[index].refs++;
+	}
+
+	/* the planes took over the references held while waiting */
+	for (i = 0; i < s->out_count; ++i) {
+		struct stream *st = s->out[i].stream;
+
+		if (st->next_buffer != -1)
+			buffer_unref(st, st->next_buffer);
+		st->next_buffer = -1;
+	}
+
+	return 0;
+}
+
+static void page_flip_handler(int fd, unsigned int sequence,
+	unsigned int tv_sec, unsigned int tv_usec, unsigned int crtc_id,
+	void *user_data)
+{
+	struct setup *s = user_data;
+	unsigned int i;
+	int ret;
+
+	/* the buffer a plane flipped away from is released by its last user */
+	for (i = 0; i < s->out_count; ++i) {
+		struct output *out = &s->out[i];
+
+		if (out->crtcId != crtc_id || out->pending == -1)
+			continue;
+
+		if (out == &s->out[0]) {
+			stats_flip(&out->stream->buffer[out->pending],
+				   tv_sec * 1000000ull + tv_usec);
+			if (s->use_drift)
+				fit_add(&drift.vblank, sequence,
+					tv_sec * 1000000ull + tv_usec);
+		}
+
+		buffer_unref(out->stream, out->shown);
+		out->shown = out->pending;
+		out->pending = -1;
+	}
+
+	if (!display_busy(s)) {
+		ret = display_commit(fd, s);
+		BYE_ON(ret, "failed to display waiting frames\n");
+	}
+}
+
+/*
+ * Legacy SetPlane sends no flip events. The vblank counter and timestamp
+ * are read without waiting instead, once per new vblank.
+ */
+static void drift_vblank(int drmfd, struct setup *s, struct output *out)
+{
+	drmVBlank vbl;
+
+	memset(&vbl, 0, sizeof vbl);
+	vbl.request.type = DRM_VBLANK_RELATIVE |
+		((out->crtcIdx << DRM_VBLANK_HIGH_CRTC_SHIFT) &
+		 DRM_VBLANK_HIGH_CRTC_MASK);
+	if (WARN_ON(drmWaitVBlank(drmfd, &vbl), "drmWaitVBlank failed, not "
+		    "estimating drift: %s\n", ERRSTR)) {
+		s->use_drift = 0;
+		return;
+	}
+
+	if (drift.vblank.n && vbl.reply.sequence == drift.last_vblank)
+		return;
+	drift.last_vblank = vbl.reply.sequence;
+	fit_add(&drift.vblank, vbl.reply.sequence,
+		vbl.reply.tval_sec * 1000000ull + vbl.reply.tval_usec);
+}
+
+/* only the newest frame of a stream waits for the display */
+static void display_queue(struct stream *st, int index)
+{
+	if (st->next_buffer != -1) {
+		buffer_unref(st, st->next_buffer);
+		st->dropped++;
+		if (st == &stream)
+			stats.drops++;
+	}
+	st->next_buffer = index;
+	st->buffer[index].refs++;
+}
+
+/*
+ * Redraws the statistics into a free overlay buffer at most once a
+ * second. The buffer is picked up by the next commit of a video frame.
+ */
+static void overlay_update(struct stream *st)
+{
+	uint64_t now = now_us();
+	unsigned int scale = st->w >= 256 ? 2 : 1;
+	struct buffer *b = NULL;
+	char line[32];
+	int i;
+
+	if (!st->buffer_count || now - stats.since < 1000000)
+		return;
+
+	for (i = 0; i < st->buffer_count; ++i)
+		if (!st->buffer[i].refs && i != st->next_buffer)
+			b = &st->buffer[i];
+	if (!b)
+		return;
+
+	qsort(stats.latency, stats.latency_count, sizeof stats.latency[0],
+	      cmp_u32);
+
+	/* translucent black background */
+	for (i = 0; i < (int)(st->w * st->h); ++i)
+		((uint32_t *)b->map)[i] = 0x80000000;
+
+	snprintf(line, sizeof line, "FPS %.1f",
+		 stats.frames_shown * 1e6 / (now - stats.since));
+	overlay_text(st, b, 4, 4, scale, line);
+	snprintf(line, sizeof line, "LAT %.1f/%.1f/%.1f MS",
+		 stats_percentile(50), stats_percentile(90),
+		 stats_percentile(99));
+	overlay_text(st, b, 4, 4 + 9 * scale, scale, line);
+	snprintf(line, sizeof line, "DROP %u", stats.drops);
+	overlay_text(st, b, 4, 4 + 18 * scale, scale, line);
+	if (stats.analysed) {
+		snprintf(line, sizeof line, "Y %.1f MOT %.2f", stats.luma,
+			 stats.motion);
+		overlay_text(st, b, 4, 4 + 27 * scale, scale, line);
+	}
+
+	/* a frame not committed yet is replaced and given back */
+	display_queue(st, b - st->buffer);
+	stats.since = now;
+	stats.frames_shown = 0;
+	stats.latency_count = 0;
+}
+
+static void display_frame(int drmfd, struct setup *s, struct stream *st,
+	int index)
+{
+	struct output *out = &s->out[0];
+	int ret;
+
+	st->current_buffer = index;
+
+	if (!s->atomic && !out->primary) {
+		ret = drmModeSetPlane(drmfd, out->planeId, out->crtcId,
+				      st->buffer[index].fb_handle, 0,
+				      out->compose.left, out->compose.top,
+				      out->compose.width,
+				      out->compose.height,
+				      out->src_x, out->src_y,
+				      out->src_w, out->src_h);
+		BYE_ON(ret, "drmModeSetPlane failed: %s\n", ERRSTR);
+
+		stats_flip(&st->buffer[index], now_us());
+		if (s->use_drift)
+			drift_vblank(drmfd, s, out);
+		st->buffer[index].refs++;
+		buffer_unref(st, out->shown);
+		out->shown = index;
+		return;
+	}
+
+	display_queue(st, index);
+	if (st == &stream || st->source == &stream)
+		overlay_update(&overlay);
+
+	if (!display_busy(s)) {
+		ret = display_commit(drmfd, s);
+		BYE_ON(ret, "failed to display buffer %d\n", index);
+	}
+}
+
+/*
+ * Where luma sits in the first plane: planar and grey formats are all
+ * luma, packed YUV interleaves it with chroma and for RGB the green
+ * channel stands in for it.
+ */
+static void luma_layout(uint32_t fourcc, unsigned int *offset,
+	unsigned int *step)
+{
+	*offset = 0;
+	*step = 1;
+
+	switch (fourcc) {
+	case V4L2_PIX_FMT_YUYV:
+	case V4L2_PIX_FMT_YVYU:
+		*step = 2;
+		break;
+	case V4L2_PIX_FMT_UYVY:
+	case V4L2_PIX_FMT_VYUY:
+		*offset = 1;
+		*step = 2;
+		break;
+	case V4L2_PIX_FMT_RGB24:
+	case V4L2_PIX_FMT_BGR24:
+		*offset = 1;
+		*step = 3;
+		break;
+	case V4L2_PIX_FMT_XBGR32:
+	case V4L2_PIX_FMT_ABGR32:
+	case V4L2_PIX_FMT_BGR32:
+		*offset = 1;
+		*step = 4;
+		break;
+	case V4L2_PIX_FMT_XRGB32:
+	case V4L2_PIX_FMT_ARGB32:
+	case V4L2_PIX_FMT_RGB32:
+		*offset = 2;
+		*step = 4;
+		break;
+	}
+}
+
+/* sum of absolute differences of a row of luma samples */
+static unsigned int row_sad(const uint8_t *a, const uint8_t *b, unsigned int n)
+{
+	v16u8 acc_lo = { 0 }, acc_hi = { 0 };
+	unsigned int sum = 0;
+	unsigned int i, j, k = 0;
+
+	for (i = 0; i + 16 <= n; i += 16) {
+		v16u8 va, vb, gt, d;
+
+		memcpy(&va, a + i, 16);
+		memcpy(&vb, b + i, 16);
+		gt = (v16u8)(va > vb);
+		d = ((va - vb) & gt) | ((vb - va) & ~gt);
+		/* nibbles, so 16 rounds fit in the 8 bit lanes */
+		acc_lo += d & 0x0f;
+		acc_hi += d >> 4;
+		if (++k == 16) {
+			for (j = 0; j < 16; ++j)
+				sum += acc_lo[j] + (acc_hi[j] << 4);
+			acc_lo = acc_hi = (v16u8){ 0 };
+			k = 0;
+		}
+	}
+	for (j = 0; j < 16; ++j)
+		sum += acc_lo[j] + (acc_hi[j] << 4);
+	for (; i < n; ++i)
+		sum += a[i] > b[i] ? a[i] - b[i] : b[i] - a[i];
+
+	return sum;
+}
+
+/*
+ * Copies luma out of the (possibly write-combined) buffer into a cached
+ * shadow with whole-row reads, so the analysis never touches the buffer.
+ */
+static void analyzer_copy(struct analyzer *an, struct buffer *b)
+{
+	uint8_t *dst = an->shadow[an->cur];
+	unsigned int x, y;
+
+	buffer_sync(b, DMA_BUF_SYNC_START | DMA_BUF_SYNC_READ);
+	for (y = 0; y < an->h; ++y) {
+		const uint8_t *row = (uint8_t *)b->map + (size_t)y * an->pitch;
+
+		if (an->step == 1) {
+			memcpy(dst + y * an->w, row, an->w);
+			continue;
+		}
+		memcpy(an->row, row, an->pitch);
+		for (x = 0; x < an->w; ++x)
+			dst[y * an->w + x] = an->row[x * an->step + an->offset];
+	}
+	buffer_sync(b, DMA_BUF_SYNC_END | DMA_BUF_SYNC_READ);
+}
+
+static void analyzer_run(struct analyzer *an, struct analysis *res)
+{
+	const uint8_t *cur = an->shadow[an->cur];
+	const uint8_t *prev = an->shadow[!an->cur];
+	/* four partial histograms avoid stalls on repeated values */
+	uint32_t hist[4][256];
+	uint64_t sum = 0, sumsq = 0;
+	size_t n = (size_t)an->w * an->h;
+	size_t i;
+	unsigned int bx, by, y, blocks = 0;
+	double motion = 0;
+
+	memset(hist, 0, sizeof hist);
+	for (i = 0; i + 4 <= n; i += 4) {
+		hist[0][cur[i]]++;
+		hist[1][cur[i + 1]]++;
+		hist[2][cur[i + 2]]++;
+		hist[3][cur[i + 3]]++;
+	}
+	for (; i < n; ++i)
+		hist[0][cur[i]]++;
+
+	for (i = 0; i < 256; ++i) {
+		res->hist[i] = hist[0][i] + hist[1][i] + hist[2][i] + hist[3][i];
+		sum += res->hist[i] * i;
+		sumsq += res->hist[i] * i * i;
+	}
+	res->mean = (double)sum / n;
+	res->variance = (double)sumsq / n - res->mean * res->mean;
+
+	res->motion = 0;
+	res->motion_max = 0;
+	res->motion_blocks = 0;
+	if (!an->have_prev)
+		return;
+
+	for (by = 0; by + MOTION_BLOCK <= an->h; by += MOTION_BLOCK) {
+		for (bx = 0; bx + MOTION_BLOCK <= an->w; bx += MOTION_BLOCK) {
+			unsigned int sad = 0;
+			double score;
+
+			for (y = by; y < by + MOTION_BLOCK; ++y)
+				sad += row_sad(cur + y * an->w + bx,
+					       prev + y * an->w + bx,
+					       MOTION_BLOCK);
+
+			score = (double)sad / (MOTION_BLOCK * MOTION_BLOCK);
+			motion += score;
+			blocks++;
+			if (score > res->motion_max)
+				res->motion_max = score;
+			if (score >= MOTION_THRESHOLD)
+				res->motion_blocks++;
+		}
+	}
+	if (blocks)
+		res->motion = motion / blocks;
+}
+
+static void *analyzer_thread(void *arg)
+{
+	struct analyzer *an = arg;
+	struct analysis res;
+	char c;
+
+	for (;;) {
+		pthread_mutex_lock(&an->lock);
+		while (!an->work)
+			pthread_cond_wait(&an->cond, &an->lock);
+		an->work = 0;
+		pthread_mutex_unlock(&an->lock);
+
+		/* the buffer goes back to the driver once copied */
+		res.sequence = an->buffer->sequence;
+		analyzer_copy(an, an->buffer);
+		c = 'c';
+		BYE_ON(write(an->notify[1], &c, 1) != 1,
+		       "analyzer: notify failed: %s\n", ERRSTR);
+
+		analyzer_run(an, &res);
+		an->cur = !an->cur;
+		an->have_prev = 1;
+
+		pthread_mutex_lock(&an->lock);
+		an->result = res;
+		pthread_mutex_unlock(&an->lock);
+
+		c = 'd';
+		BYE_ON(write(an->notify[1], &c, 1) != 1,
+		       "analyzer: notify failed: %s\n", ERRSTR);
+	}
+
+	return NULL;
+}
+
+static int analyzer_setup(struct analyzer *an, struct stream *st,
+	uint32_t fourcc)
+{
+	int ret;
+
+	an->w = st->w;
+	an->h = st->h;
+	an->pitch = st->pitch;
+	an->index = -1;
+	luma_layout(fourcc, &an->offset, &an->step);
+	if (an->w * an->step > an->pitch)
+		an->w = an->pitch / an->step;
+
+	an->shadow[0] = malloc((size_t)an->w * an->h);
+	an->shadow[1] = malloc((size_t)an->w * an->h);
+	an->row = malloc(an->pitch);
+	if (WARN_ON(!an->shadow[0] || !an->shadow[1] || !an->row,
+		    "analyzer: out of memory\n"))
+		return -1;
+
+	ret = pipe(an->notify);
+	if (WARN_ON(ret, "analyzer: pipe failed: %s\n", ERRSTR))
+		return -1;
+	fcntl(an->notify[0], F_SETFL, O_NONBLOCK);
+
+	pthread_mutex_init(&an->lock, NULL);
+	pthread_cond_init(&an->cond, NULL);
+	ret = pthread_create(&an->thread, NULL, analyzer_thread, an);
+	if (WARN_ON(ret, "analyzer: pthread_create failed: %s\n",
+		    strerror(ret)))
+		return -1;
+
+	return 0;
+}
+
+/*
+ * Hands a displayed frame to the worker if it is idle. Frames arriving
+ * while it is busy are not analysed, so display is never held up.
+ */
+static void analyzer_submit(struct analyzer *an, struct stream *st, int index)
+{
+	if (an->notify[0] < 0 || an->busy || !st->buffer[index].map ||
+	    st->qos_level)
+		return;
+
+	an->busy = 1;
+	an->index = index;
+	an->buffer = &st->buffer[index];
+	st->buffer[index].refs++;
+
+	pthread_mutex_lock(&an->lock);
+	an->work = 1;
+	pthread_cond_signal(&an->cond);
+	pthread_mutex_unlock(&an->lock);
+}
+
+static void analysis_publish(struct analysis *res)
+{
+	char msg[3072];
+	int len;
+	unsigned int i;
+
+	stats.luma = res->mean;
+	stats.motion = res->motion;
+
+	len = snprintf(msg, sizeof msg, "analysis seq=%u mean=%.2f "
+		       "variance=%.2f motion=%.3f motion_max=%.3f "
+		       "motion_blocks=%u hist=", res->sequence, res->mean,
+		       res->variance, res->motion, res->motion_max,
+		       res->motion_blocks);
+	for (i = 0; i < 256 && len < (int)sizeof msg; ++i)
+		len += snprintf(msg + len, sizeof msg - len, "%s%u",
+				i ? "," : "", res->hist[i]);
+	if (len < (int)sizeof msg - 1)
+		len += snprintf(msg + len, sizeof msg - len, "\n");
+
+	control_publish(&control, msg);
+}
+
+/* runs in the main thread when the worker reports progress */
+static void analyzer_handle(struct analyzer *an, struct stream *st)
+{
+	struct analysis res;
+	char c;
+
+	while (read(an->notify[0], &c, 1) == 1) {
+		if (c == 'c') {
+			/* copied to the shadow, the buffer can go back */
+			buffer_unref(st, an->index);
+			an->index = -1;
+			continue;
+		}
+
+		pthread_mutex_lock(&an->lock);
+		res = an->result;
+		pthread_mutex_unlock(&an->lock);
+		an->busy = 0;
+
+		stats.analysed++;
+		analysis_publish(&res);
+	}
+}
+
+/*
+ * Previews are written to a shared file, normally under /dev/shm: a
+ * thumb_file header followed by one slot per captured stream. A slot is
+ * consistent when its seq was even and unchanged across the read.
+ */
+static int thumb_setup(struct setup *s, struct stream **st, unsigned int count)
+{
+	struct thumb_file *f;
+	size_t size, offset[THUMB_MAX_STREAMS];
+	unsigned int i;
+	int fd, ret;
+
+	size = sizeof *f;
+	for (i = 0; i < count; ++i) {
+		size = (size + 63) & ~(size_t)63;
+		offset[i] = size;
+		size += sizeof(struct thumb_slot) +
+			(st[i]->w / THUMB_SCALE) * (st[i]->h / THUMB_SCALE);
+	}
+
+	fd = open(s->thumb, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (WARN_ON(fd < 0, "thumb: failed to open %s: %s\n", s->thumb,
+		    ERRSTR))
+		return -1;
+	ret = ftruncate(fd, size);
+	if (WARN_ON(ret, "thumb: ftruncate failed: %s\n", ERRSTR)) {
+		close(fd);
+		return -1;
+	}
+	f = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (WARN_ON(f == MAP_FAILED, "thumb: mmap failed: %s\n", ERRSTR))
+		return -1;
+
+	f->count = count;
+	for (i = 0; i < count; ++i) {
+		struct thumb_slot *slot = (void *)((uint8_t *)f + offset[i]);
+
+		f->offset[i] = offset[i];
+		slot->width = st[i]->w / THUMB_SCALE;
+		slot->height = st[i]->h / THUMB_SCALE;
+		st[i]->thumb = slot;
+		luma_layout(s->in_fourcc, &st[i]->luma_offset,
+			    &st[i]->luma_step);
+		st[i]->row = malloc(st[i]->pitch);
+		st[i]->acc = malloc(slot->width * sizeof *st[i]->acc);
+		if (WARN_ON(!st[i]->row || !st[i]->acc, "out of memory\n"))
+			return -1;
+	}
+	/* readers wait for the magic before trusting the layout */
+	__atomic_store_n(&f->magic, THUMB_MAGIC, __ATOMIC_RELEASE);
+
+	printf("thumb: %u previews in %s\n", count, s->thumb);
+	return 0;
+}
+
+/*
+ * Box filters every THUMB_SCALE x THUMB_SCALE block of luma into one grey
+ * pixel. Each block column is one vector lane set, so a source row is
+ * added with a single vector op per output pixel. Called once the frame
+ * has been handed to the display, so it never delays the frame itself.
+ */
+static void thumb_update(struct setup *s, struct stream *st, int index)
+{
+	struct thumb_slot *slot = st->thumb;
+	struct buffer *b = &st->buffer[index];
+	unsigned int x, y, r, i, lw;
+	uint32_t seq;
+
+	if (!slot || st->qos_level || ++st->thumb_skip < s->thumb_every)
+		return;
+	st->thumb_skip = 0;
+
+	lw = slot->width * THUMB_SCALE;
+	seq = slot->seq;
+	__atomic_store_n(&slot->seq, seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	buffer_sync(b, DMA_BUF_SYNC_START | DMA_BUF_SYNC_READ);
+	for (y = 0; y < slot->height; ++y) {
+		memset(st->acc, 0, slot->width * sizeof *st->acc);
+
+		for (r = 0; r < THUMB_SCALE; ++r) {
+			const uint8_t *src = (uint8_t *)b->map +
+				(size_t)(y * THUMB_SCALE + r) * st->pitch;
+
+			/* one sequential read of write-combined memory */
+			memcpy(st->row, src, st->pitch);
+			if (st->luma_step > 1)
+				for (i = 0; i < lw; ++i)
+					st->row[i] = st->row[i * st->luma_step +
+						st->luma_offset];
+
+			for (x = 0; x < slot->width; ++x) {
+				v8u8 v;
+
+				memcpy(&v, st->row + x * THUMB_SCALE, sizeof v);
+				st->acc[x] += __builtin_convertvector(v, v8u16);
+			}
+		}
+
+		for (x = 0; x < slot->width; ++x) {
+			unsigned int sum = 0;
+
+			for (i = 0; i < THUMB_SCALE; ++i)
+				sum += st->acc[x][i];
+			slot->pixels[y * slot->width + x] =
+				sum / (THUMB_SCALE * THUMB_SCALE);
+		}
+	}
+	buffer_sync(b, DMA_BUF_SYNC_END | DMA_BUF_SYNC_READ);
+
+	slot->sequence = b->sequence;
+	slot->timestamp = b->timestamp;
+	__atomic_store_n(&slot->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+struct trace_frame {
+	uint32_t sequence;
+	/* capture timestamp and when it reached us */
+	uint64_t timestamp;
+	uint64_t dequeued;
+};
+
+struct trace {
+	struct trace_frame *frames;
+	unsigned int frame_count;
+	/* flips of the main output, with the latency each frame saw */
+	uint64_t *flips;
+	uint32_t *latency;
+	unsigned int flip_count;
+	unsigned int commit_count;
+	/* how the recorded run presented frames */
+	char mode[16];
+	unsigned int vrefresh;
+};
+
+/*
+ * Scheduling policies replayed against a trace. FIFO shows every frame
+ * in order, mailbox is what this program does, late latching commits
+ * the newest frame just before the vblank instead of right away.
+ */
+enum { POLICY_FIFO, POLICY_MAILBOX, POLICY_LATE };
+
+static const struct policy {
+	const char *name;
+	int type;
+	unsigned int buffers;
+} policies[] = {
+	{ "fifo", POLICY_FIFO, 3 },
+	{ "fifo", POLICY_FIFO, 4 },
+	{ "fifo", POLICY_FIFO, 6 },
+	{ "mailbox", POLICY_MAILBOX, 3 },
+	{ "mailbox", POLICY_MAILBOX, 4 },
+	{ "late-latch", POLICY_LATE, 3 },
+	{ "late-latch", POLICY_LATE, 4 },
+};
+
+/* time before the vblank by which a commit has to be made */
+#define LATCH_MARGIN_US 2000
+#define MAX_QUEUED 8
+
+struct policy_result {
+	unsigned int shown;
+	unsigned int drops;
+	unsigned int latency_count;
+	uint32_t *latency;
+};
+
+static int trace_load(const char *path, struct trace *t)
+{
+	unsigned int frames_max = 0, flips_max = 0;
+	unsigned long long a, b, c;
+	char line[128];
+	FILE *f;
+
+	memset(t, 0, sizeof *t);
+	strcpy(t->mode, "vsync");
+	f = fopen(path, "r");
+	if (WARN_ON(!f, "failed to open %s: %s\n", path, ERRSTR))
+		return -1;
+
+	while (fgets(line, sizeof line, f)) {
+		if (sscanf(line, "c %llu %llu %llu", &a, &b, &c) == 3) {
+			if (t->frame_count == frames_max) {
+				frames_max = frames_max ? frames_max * 2 : 1024;
+				t->frames = realloc(t->frames, frames_max *
+						    sizeof *t->frames);
+				if (WARN_ON(!t->frames, "out of memory\n"))
+					break;
+			}
+			t->frames[t->frame_count].sequence = a;
+			t->frames[t->frame_count].timestamp = b;
+			t->frames[t->frame_count].dequeued = c;
+			t->frame_count++;
+		} else if (sscanf(line, "f %llu %llu", &a, &b) == 2) {
+			if (t->flip_count == flips_max) {
+				flips_max = flips_max ? flips_max * 2 : 1024;
+				t->flips = realloc(t->flips, flips_max *
+						   sizeof *t->flips);
+				t->latency = realloc(t->latency, flips_max *
+						     sizeof *t->latency);
+				if (WARN_ON(!t->flips || !t->latency,
+					    "out of memory\n"))
+					break;
+			}
+			t->flips[t->flip_count] = a;
+			t->latency[t->flip_count] = a > b ? a - b : 0;
+			t->flip_count++;
+		} else if (line[0] == 'm') {
+			t->commit_count++;
+		} else if (sscanf(line, "# %15s %u", t->mode,
+				  &t->vrefresh) >= 1) {
+			continue;
+		}
+	}
+	fclose(f);
+
+	return t->frames && t->flips ? 0 : -1;
+}
+
+/*
+ * Flips only happen when there was a new frame, so the shortest gap
+ * between flips is about one refresh period. Gaps close to it are
+ * averaged to smooth out timestamp jitter.
+ */
+static uint64_t trace_period(struct trace *t)
+{
+	uint64_t min = UINT64_MAX, sum = 0, d;
+	unsigned int i, n = 0;
+
+	/* async flips are not tied to the vblank */
+	if (strcmp(t->mode, "async") == 0 && t->vrefresh)
+		return 1000000 / t->vrefresh;
+
+	for (i = 1; i < t->flip_count; ++i) {
+		d = t->flips[i] - t->flips[i - 1];
+		if (d > 1000 && d < min)
+			min = d;
+	}
+	if (min == UINT64_MAX)
+		return 0;
+
+	for (i = 1; i < t->flip_count; ++i) {
+		d = t->flips[i] - t->flips[i - 1];
+		if (d >= min && d <= min + min / 4) {
+			sum += d;
+			n++;
+		}
+	}
+
+	return sum / n;
+}
+
+static void policy_show(struct policy_result *r, struct trace_frame *f,
+	uint64_t vblank)
+{
+	r->shown++;
+	r->latency[r->latency_count++] = vblank - f->timestamp;
+}
+
+static void policy_run(const struct policy *p, struct trace *t,
+	uint64_t period, struct policy_result *r)
+{
+	struct trace_frame *queue[MAX_QUEUED];
+	struct trace_frame *pending = NULL, *mailbox = NULL;
+	uint64_t committed = 0, vblank;
+	unsigned int queued = 0, held, i = 0, j;
+	int displayed = 0, pass;
+
+	memset(r, 0, sizeof *r);
+	r->latency = calloc(t->frame_count, sizeof *r->latency);
+	if (WARN_ON(!r->latency, "out of memory\n"))
+		return;
+
+	/* vblanks are aligned with the recorded flips */
+	vblank = t->flips[0];
+	while (vblank > t->frames[0].dequeued)
+		vblank -= period;
+
+	for (; i < t->frame_count; vblank += period) {
+		for (pass = 0; pass < 2; ++pass) {
+			/*
+			 * Frames before the margin can still make this vblank,
+			 * those after it wait for the next one.
+			 */
+			uint64_t until = pass ? vblank : vblank - LATCH_MARGIN_US;
+
+			for (; i < t->frame_count &&
+			     t->frames[i].dequeued < until; ++i) {
+				struct trace_frame *f = &t->frames[i];
+
+				held = displayed + !!pending + !!mailbox +
+					queued;
+				if (held >= p->buffers) {
+					/* the driver had no buffer to fill */
+					r->drops++;
+					continue;
+				}
+
+				if (p->type == POLICY_FIFO) {
+					if (!pending && !queued) {
+						pending = f;
+						committed = f->dequeued;
+					} else {
+						queue[queued++] = f;
+					}
+					continue;
+				}
+
+				if (mailbox)
+					r->drops++;
+				mailbox = f;
+				if (p->type == POLICY_MAILBOX && !pending) {
+					pending = mailbox;
+					committed = f->dequeued;
+					mailbox = NULL;
+				}
+			}
+
+			if (!pass && p->type == POLICY_LATE && mailbox &&
+			    !pending) {
+				pending = mailbox;
+				committed = vblank - LATCH_MARGIN_US;
+				mailbox = NULL;
+			}
+		}
+
+		if (!pending || committed > vblank - LATCH_MARGIN_US)
+			continue;
+
+		policy_show(r, pending, vblank);
+		displayed = 1;
+		pending = NULL;
+
+		/* the flip event commits whatever waits next */
+		if (p->type == POLICY_FIFO && queued) {
+			pending = queue[0];
+			for (j = 1; j < queued; ++j)
+				queue[j - 1] = queue[j];
+			queued--;
+			committed = vblank;
+		} else if (p->type == POLICY_MAILBOX && mailbox) {
+			pending = mailbox;
+			committed = vblank;
+			mailbox = NULL;
+		}
+	}
+
+	qsort(r->latency, r->latency_count, sizeof *r->latency, cmp_u32);
+}
+
+/*
+ * Replays a trace recorded with -L through each scheduling policy and
+ * reports the latency and drops it would have given, next to what was
+ * actually recorded.
+ */
+static int trace_replay(const char *path)
+{
+	struct policy_result r;
+	struct trace t;
+	uint64_t period;
+	char label[24];
+	unsigned int i, lost = 0;
+
+	if (trace_load(path, &t))
+		return -1;
+
+	period = trace_period(&t);
+	if (WARN_ON(!period, "trace: not enough flips to find refresh rate\n"))
+		return -1;
+
+	for (i = 1; i < t.frame_count; ++i)
+		if (t.frames[i].sequence - t.frames[i - 1].sequence > 1)
+			lost += t.frames[i].sequence -
+				t.frames[i - 1].sequence - 1;
+
+	printf("trace: %u frames, %u commits, %u flips, refresh %.2f Hz\n",
+	       t.frame_count, t.commit_count, t.flip_count, 1e6 / period);
+	printf("%-12s %7s %6s %6s %8s %8s\n", "policy", "buffers", "shown",
+	       "drops", "p50 ms", "p99 ms");
+
+	qsort(t.latency, t.flip_count, sizeof *t.latency, cmp_u32);
+	/* a run recorded with -X compares async against vsynced policies */
+	snprintf(label, sizeof label, "rec-%s", t.mode);
+	printf("%-12s %7s %6u %6u %8.2f %8.2f\n", label, "-",
+	       t.flip_count, lost + t.frame_count - t.flip_count,
+	       percentile(t.latency, t.flip_count, 50),
+	       percentile(t.latency, t.flip_count, 99));
+
+	for (i = 0; i < sizeof(policies) / sizeof(policies[0]); ++i) {
+		const struct policy *p = &policies[i];
+
+		policy_run(p, &t, period, &r);
+		printf("%-12s %7u %6u %6u %8.2f %8.2f\n", p->name, p->buffers,
+		       r.shown, lost + r.drops,
+		       percentile(r.latency, r.latency_count, 50),
+		       percentile(r.latency, r.latency_count, 99));
+		free(r.latency);
+	}
+
+	return 0;
+}
+
+/*
+ * The right eye of a stereo pair uses the same size and format as the
+ * left one. With two outputs each eye gets its own CRTC, otherwise the
+ * first output is split into two halves side by side.
+ */
+static int stereo_setup(int drmfd, struct setup *s, struct stream *st)
+{
+	struct v4l2_capability caps;
+	struct v4l2_format fmt;
+	struct output *out;
+	int ret;
+
+	st->v4lfd = open(s->stereo, O_RDWR);
+	if (WARN_ON(st->v4lfd < 0, "failed to open %s: %s\n", s->stereo,
+		    ERRSTR))
+		return -1;
+
+	memset(&caps, 0, sizeof caps);
+	ret = ioctl(st->v4lfd, VIDIOC_QUERYCAP, &caps);
+	if (WARN_ON(ret, "stereo: VIDIOC_QUERYCAP failed: %s\n", ERRSTR))
+		return -1;
+	if (WARN_ON(~caps.capabilities & V4L2_CAP_VIDEO_CAPTURE,
+		    "stereo: singleplanar capture is not supported\n"))
+		return -1;
+
+	memset(&fmt, 0, sizeof fmt);
+	fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	ret = ioctl(st->v4lfd, VIDIOC_G_FMT, &fmt);
+	if (WARN_ON(ret < 0, "stereo: VIDIOC_G_FMT failed: %s\n", ERRSTR))
+		return -1;
+	fmt.fmt.pix.width = s->w;
+	fmt.fmt.pix.height = s->h;
+	fmt.fmt.pix.pixelformat = s->in_fourcc;
+	fmt.fmt.pix.bytesperline = 0;
+	fmt.fmt.pix.sizeimage = 0;
+	ret = ioctl(st->v4lfd, VIDIOC_S_FMT, &fmt);
+	if (WARN_ON(ret < 0, "stereo: VIDIOC_S_FMT failed: %s\n", ERRSTR))
+		return -1;
+	if (WARN_ON(fmt.fmt.pix.width != s->w || fmt.fmt.pix.height != s->h ||
+		    fmt.fmt.pix.pixelformat != s->in_fourcc,
+		    "stereo: %ux%u %.4s does not match the left eye\n",
+		    fmt.fmt.pix.width, fmt.fmt.pix.height,
+		    (char*)&fmt.fmt.pix.pixelformat))
+		return -1;
+
+	ret = stream_alloc(drmfd, st, &fmt, s->out_fourcc, s->buffer_count);
+	if (ret)
+		return -1;
+
+	if (s->out_count == 2) {
+		s->out[1].stream = st;
+		printf("stereo: right eye on crtc %u\n", s->out[1].crtcId);
+		return 0;
+	}
+
+	if (WARN_ON(s->out_count == MAX_OUTPUTS, "too many planes\n"))
+		return -1;
+
+	out = &s->out[s->out_count];
+	*out = s->out[0];
+	out->stream = st;
+	out->planeId = 0;
+	out->shown = -1;
+	out->pending = -1;
+
+	s->out[0].compose.width /= 2;
+	out->compose.left = s->out[0].compose.left + s->out[0].compose.width;
+	out->compose.width -= s->out[0].compose.width;
+
+	ret = find_plane(drmfd, s, out);
+	if (WARN_ON(ret, "stereo: no free plane on crtc %u\n", out->crtcId))
+		return -1;
+	s->out_count++;
+
+	printf("stereo: side by side on planes %u and %u\n",
+	       s->out[0].planeId, out->planeId);
+	return 0;
+}
+
+static void stereo_stats(int64_t skew)
+{
+	uint64_t abs_skew = skew < 0 ? -skew : skew;
+
+	pairing.skew_sum += abs_skew;
+	if (abs_skew > pairing.skew_max)
+		pairing.skew_max = abs_skew;
+
+	if (++pairing.pairs % 300)
+		return;
+	printf("stereo: skew avg %.2f ms, max %.2f ms, %u unpaired in the "
+	       "last 300 pairs\n", pairing.skew_sum / 300 / 1000.0,
+	       pairing.skew_max / 1000.0, pairing.unpaired);
+	pairing.skew_sum = 0;
+	pairing.skew_max = 0;
+	pairing.unpaired = 0;
+}
+
+/*
+ * Each eye keeps its newest unpaired frame. A frame is paired with the
+ * waiting one from the other eye if they were captured within the
+ * tolerance, otherwise the older of the two is dropped. Pairs go to the
+ * display together so both planes are updated by the same commit.
+ */
+static void stereo_frame(int drmfd, struct setup *s, struct stream *st,
+	int index)
+{
+	struct stream *other = st == &stream ? &stereo : &stream;
+	int *mine = &pairing.waiting[st != &stream];
+	int *theirs = &pairing.waiting[st == &stream];
+	int64_t skew;
+	int ret;
+
+	if (*mine != -1) {
+		buffer_unref(st, *mine);
+		pairing.unpaired++;
+	}
+	*mine = index;
+	st->buffer[index].refs++;
+
+	if (*theirs == -1)
+		return;
+
+	skew = (int64_t)(st->buffer[*mine].timestamp -
+			 other->buffer[*theirs].timestamp);
+	if (skew > pairing.tolerance || -skew > pairing.tolerance) {
+		/* the older frame will not get a partner any more */
+		if (skew > 0) {
+			buffer_unref(other, *theirs);
+			*theirs = -1;
+		} else {
+			buffer_unref(st, *mine);
+			*mine = -1;
+		}
+		pairing.unpaired++;
+		return;
+	}
+	stereo_stats(skew);
+
+	/* the display takes over the references held while waiting */
+	st->current_buffer = *mine;
+	other->current_buffer = *theirs;
+	display_queue(st, *mine);
+	display_queue(other, *theirs);
+	buffer_unref(st, *mine);
+	buffer_unref(other, *theirs);
+	*mine = -1;
+	*theirs = -1;
+
+	overlay_update(&overlay);
+	if (!display_busy(s)) {
+		ret = display_commit(drmfd, s);
+		BYE_ON(ret, "failed to display stereo pair\n");
+	}
+}
+
+/*
+ * Inputs of a multiplexed capture device share one queue and one buffer
+ * pool. Each input gets a view of the stream and its own tile of the
+ * first output, so a tile keeps its last frame while other inputs are
+ * captured.
+ */
+static int mux_setup(int drmfd, struct setup *s, int v4lfd)
+{
+	struct v4l2_rect area = s->out[0].compose;
+	unsigned int cols = 1, rows, i;
+	int input = mux.input[0];
+	int ret;
+
+	for (i = 0; i < mux.count; ++i) {
+		struct v4l2_input in;
+
+		memset(&in, 0, sizeof in);
+		in.index = mux.input[i];
+		ret = ioctl(v4lfd, VIDIOC_ENUMINPUT, &in);
+		if (WARN_ON(ret, "mux: input %u does not exist\n",
+			    mux.input[i]))
+			return -1;
+		printf("mux: input %u: %.32s\n", in.index, in.name);
+	}
+
+	ret = ioctl(v4lfd, VIDIOC_S_INPUT, &input);
+	if (WARN_ON(ret, "VIDIOC_S_INPUT failed: %s\n", ERRSTR))
+		return -1;
+
+	/* every tile holds up to two frames, one more is being filled */
+	WARN_ON((unsigned int)stream.buffer_count < 2 * mux.count + 2,
+		"mux: %d buffers "
+		"may stall capture, %u recommended\n", stream.buffer_count,
+		2 * mux.count + 2);
+
+	while (cols * cols < mux.count)
+		cols++;
+	rows = (mux.count + cols - 1) / cols;
+
+	for (i = 0; i < mux.count; ++i) {
+		struct stream *view = &stream;
+		struct output *out = &s->out[0];
+
+		if (i) {
+			if (WARN_ON(s->out_count == MAX_OUTPUTS,
+				    "too many planes\n"))
+				return -1;
+
+			view = &mux.views[i];
+			*view = stream;
+			view->source = &stream;
+			view->current_buffer = -1;
+			view->next_buffer = -1;
+
+			out = &s->out[s->out_count];
+			*out = s->out[0];
+			out->stream = view;
+			out->planeId = 0;
+			out->shown = -1;
+			out->pending = -1;
+			ret = find_plane(drmfd, s, out);
+			if (WARN_ON(ret, "mux: no free plane for input %u\n",
+				    mux.input[i]))
+				return -1;
+			s->out_count++;
+		}
+
+		out->compose.width = area.width / cols;
+		out->compose.height = area.height / rows;
+		out->compose.left = area.left + (i % cols) * out->compose.width;
+		out->compose.top = area.top + (i / cols) * out->compose.height;
+		mux.view[i] = view;
+	}
+
+	mux.settle = 0;
+	printf("mux: %u inputs in a %ux%u mosaic, %u frames each\n",
+	       mux.count, cols, rows, mux.dwell);
+	return 0;
+}
+
+/*
+ * Drivers that cannot switch inputs while streaming get stopped, switched
+ * and restarted. Stopping returns every queued buffer, so all buffers not
+ * held by the display are queued again.
+ */
+static int mux_switch(int v4lfd)
+{
+	int type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	unsigned int next = (mux.current + 1) % mux.count;
+	int input = mux.input[next];
+	int ret, i;
+
+	ret = ioctl(v4lfd, VIDIOC_S_INPUT, &input);
+	if (ret && errno == EBUSY) {
+		ret = ioctl(v4lfd, VIDIOC_STREAMOFF, &type);
+		if (WARN_ON(ret, "mux: STREAMOFF failed: %s\n", ERRSTR))
+			return -1;
+
+		ret = ioctl(v4lfd, VIDIOC_S_INPUT, &input);
+		WARN_ON(ret, "VIDIOC_S_INPUT failed: %s\n", ERRSTR);
+
+		for (i = 0; i < stream.buffer_count; ++i)
+			if (!stream.buffer[i].refs && video_queue(&stream, i))
+				return -1;
+		if (WARN_ON(ioctl(v4lfd, VIDIOC_STREAMON, &type),
+			    "mux: STREAMON failed: %s\n", ERRSTR))
+			return -1;
+		mux.restarts++;
+	} else if (WARN_ON(ret, "VIDIOC_S_INPUT failed: %s\n", ERRSTR)) {
+		return -1;
+	}
+
+	if (ret)
+		return 0;
+
+	mux.current = next;
+	mux.frames = 0;
+	/* the frame being captured during the switch may be torn */
+	mux.settle = MUX_SETTLE_FRAMES;
+
+	if (++mux.switches % 300 == 0) {
+		printf("mux: %u of the last 300 switches restarted streaming\n",
+		       mux.restarts);
+		mux.restarts = 0;
+	}
+	return 0;
+}
+
+static void mux_frame(int drmfd, struct setup *s, int index)
+{
+	struct stream *view = mux.view[mux.current];
+	int ret;
+
+	if (mux.settle) {
+		mux.settle--;
+		buffer_release(&stream, index);
+		return;
+	}
+
+	display_frame(drmfd, s, view, index);
+
+	if (mux.count > 1 && ++mux.frames >= mux.dwell) {
+		ret = mux_switch(stream.v4lfd);
+		BYE_ON(ret, "failed to switch input\n");
+	}
+}
+
+/* time the main loop spends waiting, the rest is work */
+static int qos_poll(struct pollfd *fds, nfds_t count, int timeout)
+{
+	uint64_t start = now_us();
+	int ret;
+
+	ret = poll(fds, count, timeout);
+	qos.idle += now_us() - start;
+	return ret;
+}
+
+static const char *const qos_levels[] = {
+	"full service", "no CPU stages", "half rate", "quarter rate",
+};
+
+/* lowest priority stream that can still shed load, or NULL */
+static struct stream *qos_victim(void)
+{
+	struct stream *victim = NULL;
+	unsigned int i;
+
+	for (i = 0; i < qos.count; ++i) {
+		struct stream *st = qos.stream[i];
+
+		/* the most important streams keep their full rate */
+		if (st->priority == qos.top || st->qos_level == QOS_MAX_LEVEL)
+			continue;
+		if (!victim || st->priority > victim->priority ||
+		    (st->priority == victim->priority &&
+		     st->qos_level < victim->qos_level))
+			victim = st;
+	}
+	return victim;
+}
+
+/* most important degraded stream, or NULL */
+static struct stream *qos_restorable(void)
+{
+	struct stream *best = NULL;
+	unsigned int i;
+
+	for (i = 0; i < qos.count; ++i) {
+		struct stream *st = qos.stream[i];
+
+		if (st->qos_level && (!best || st->priority < best->priority))
+			best = st;
+	}
+	return best;
+}
+
+static void qos_log(struct stream *st, const char *what, double busy,
+	unsigned int drops)
+{
+	printf("qos: %s %s to %s (busy %.0f%%, %u drops), %u degraded and "
+	       "%u restored so far\n", st->name, what,
+	       qos_levels[st->qos_level], busy * 100, drops, qos.degraded,
+	       qos.restored);
+}
+
+/*
+ * Once per window the share of time spent handling events and the frames
+ * the high priority streams lost decide whether the box is overloaded.
+ * Load is shed one step at a time from the least important stream and
+ * given back in priority order once things stay calm.
+ */
+static void qos_update(void)
+{
+	uint64_t now = now_us();
+	unsigned int drops = 0, i;
+	struct stream *st;
+	double busy;
+
+	if (!qos.since) {
+		qos.since = now;
+		qos.idle = 0;
+	}
+	if (now - qos.since < QOS_WINDOW_US)
+		return;
+
+	busy = 1 - (double)qos.idle / (now - qos.since);
+	for (i = 0; i < qos.count; ++i) {
+		if (qos.stream[i]->priority == qos.top)
+			drops += qos.stream[i]->dropped -
+				qos.stream[i]->qos_dropped;
+		qos.stream[i]->qos_dropped = qos.stream[i]->dropped;
+	}
+	qos.since = now;
+	qos.idle = 0;
+
+	if (busy > QOS_BUSY_HIGH || drops) {
+		qos.calm = 0;
+		st = qos_victim();
+		if (!st)
+			return;
+		st->qos_level++;
+		qos.degraded++;
+		qos_log(st, "degraded", busy, drops);
+	} else if (busy < QOS_BUSY_LOW && ++qos.calm >= QOS_CALM_WINDOWS) {
+		qos.calm = 0;
+		st = qos_restorable();
+		if (!st)
+			return;
+		st->qos_level--;
+		qos.restored++;
+		qos_log(st, "restored", busy, drops);
+	}
+}
+
+/* drops frames of streams running at reduced rate */
+static int qos_skip(struct stream *st, int index)
+{
+	int ret;
+
+	if (st->qos_level < 2 ||
+	    ++st->qos_count % (1u << (st->qos_level - 1)) == 0)
+		return 0;
+
+	ret = video_queue(st, index);
+	BYE_ON(ret, "failed to requeue buffer %d\n", index);
+	return 1;
+}
+
+static int sink_reqbufs(struct sink *k, unsigned int memory, unsigned int count)
+{
+	struct v4l2_requestbuffers rqbufs;
+	int ret;
+
+	memset(&rqbufs, 0, sizeof(rqbufs));
+	rqbufs.count = count;
+	rqbufs.type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
+	rqbufs.memory = memory;
+	ret = ioctl(k->fd, VIDIOC_REQBUFS, &rqbufs);
+	if (ret)
+		return -1;
+	k->count = rqbufs.count;
+	return 0;
+}
+
+/*
+ * Copies into buffers of the output device, for devices that cannot
+ * import our dmabufs. Capture buffers are mapped to read them.
+ */
+static int sink_fallback(struct sink *k, struct stream *st, const char *why)
+{
+	int type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
+	unsigned int i;
+	int ret;
+
+	printf("sink: %s does not import dmabufs (%s), copying frames\n",
+	       k->node, why);
+	ioctl(k->fd, VIDIOC_STREAMOFF, &type);
+	sink_reqbufs(k, V4L2_MEMORY_DMABUF, 0);
+
+	/* frames queued for import are no longer used by the device */
+	for (i = 0; i < MAX_SINK_BUFFERS; ++i)
+		if (k->queued[i]) {
+			k->queued[i] = 0;
+			buffer_unref(st, i);
+		}
+
+	ret = sink_reqbufs(k, V4L2_MEMORY_MMAP, SINK_COPY_BUFFERS);
+	if (WARN_ON(ret, "sink: VIDIOC_REQBUFS failed: %s\n", ERRSTR))
+		return -1;
+	if (k->count > MAX_SINK_BUFFERS)
+		k->count = MAX_SINK_BUFFERS;
+
+	for (i = 0; i < k->count; ++i) {
+		struct v4l2_buffer buf;
+
+		memset(&buf, 0, sizeof buf);
+		buf.index = i;
+		buf.type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
+		buf.memory = V4L2_MEMORY_MMAP;
+		ret = ioctl(k->fd, VIDIOC_QUERYBUF, &buf);
+		if (WARN_ON(ret, "sink: VIDIOC_QUERYBUF failed: %s\n", ERRSTR))
+			return -1;
+		k->map[i] = mmap(NULL, buf.length, PROT_READ | PROT_WRITE,
+				 MAP_SHARED, k->fd, buf.m.offset);
+		if (WARN_ON(k->map[i] == MAP_FAILED, "sink: mmap failed: %s\n",
+			    ERRSTR))
+			return -1;
+		k->length[i] = buf.length;
+	}
+
+	for (i = 0; i < (unsigned int)st->buffer_count; ++i) {
+		if (st->buffer[i].map)
+			continue;
+		ret = buffer_map(k->drmfd, &st->buffer[i], st->buffer_size);
+		if (ret)
+			return -1;
+	}
+
+	k->copy = 1;
+	ret = ioctl(k->fd, VIDIOC_STREAMON, &type);
+	if (WARN_ON(ret, "sink: STREAMON failed: %s\n", ERRSTR))
+		return -1;
+	return 0;
+}
+
+/*
+ * Forwards captured frames to a V4L2 output device such as v4l2loopback,
+ * so other applications can use them as a camera. Capture buffers are
+ * handed over by dmabuf fd, using the same index on both queues.
+ */
+static int sink_setup(struct sink *k, int drmfd, struct stream *st,
+	uint32_t fourcc)
+{
+	int type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
+	struct v4l2_capability caps;
+	struct v4l2_format fmt;
+	int ret;
+
+	k->drmfd = drmfd;
+	k->fd = open(k->node, O_RDWR | O_NONBLOCK);
+	if (WARN_ON(k->fd < 0, "failed to open %s: %s\n", k->node, ERRSTR))
+		return -1;
+
+	memset(&caps, 0, sizeof caps);
+	ret = ioctl(k->fd, VIDIOC_QUERYCAP, &caps);
+	if (WARN_ON(ret, "sink: VIDIOC_QUERYCAP failed: %s\n", ERRSTR))
+		return -1;
+	if (WARN_ON(~caps.capabilities & V4L2_CAP_VIDEO_OUTPUT,
+		    "sink: %s is not a video output\n", k->node))
+		return -1;
+
+	memset(&fmt, 0, sizeof fmt);
+	fmt.type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
+	fmt.fmt.pix.width = st->w;
+	fmt.fmt.pix.height = st->h;
+	fmt.fmt.pix.pixelformat = fourcc;
+	fmt.fmt.pix.bytesperline = st->pitch;
+	fmt.fmt.pix.sizeimage = st->buffer_size;
+	fmt.fmt.pix.field = V4L2_FIELD_NONE;
+	ret = ioctl(k->fd, VIDIOC_S_FMT, &fmt);
+	if (WARN_ON(ret, "sink: VIDIOC_S_FMT failed: %s\n", ERRSTR))
+		return -1;
+	if (WARN_ON(fmt.fmt.pix.width != st->w || fmt.fmt.pix.height != st->h ||
+		    fmt.fmt.pix.pixelformat != fourcc,
+		    "sink: %ux%u %.4s is not supported\n", st->w, st->h,
+		    (char*)&fourcc))
+		return -1;
+	k->sizeimage = fmt.fmt.pix.sizeimage;
+	k->pitch = fmt.fmt.pix.bytesperline;
+
+	if (WARN_ON(st->buffer_count > MAX_SINK_BUFFERS, "sink: too many "
+		    "buffers\n"))
+		return -1;
+
+	ret = sink_reqbufs(k, V4L2_MEMORY_DMABUF, st->buffer_count);
+	if (ret || k->count < (unsigned int)st->buffer_count ||
+	    k->pitch != st->pitch)
+		return sink_fallback(k, st, ret ? ERRSTR : "layout differs");
+
+	ret = ioctl(k->fd, VIDIOC_STREAMON, &type);
+	if (WARN_ON(ret, "sink: STREAMON failed: %s\n", ERRSTR))
+		return -1;
+
+	printf("sink: forwarding to %s by dmabuf, zero-copy\n", k->node);
+	return 0;
+}
+
+static void sink_copy(struct sink *k, struct stream *st, struct buffer *b,
+	unsigned int slot)
+{
+	uint8_t *dst = k->map[slot];
+	const uint8_t *src = b->map;
+	size_t row = k->pitch < st->pitch ? k->pitch : st->pitch;
+	unsigned int y;
+
+	buffer_sync(b, DMA_BUF_SYNC_START | DMA_BUF_SYNC_READ);
+	if (k->pitch == st->pitch)
+		memcpy(dst, src, k->sizeimage < b->size ? k->sizeimage :
+		       b->size);
+	else
+		for (y = 0; y < st->h; ++y)
+			memcpy(dst + y * k->pitch, src + y * st->pitch, row);
+	buffer_sync(b, DMA_BUF_SYNC_END | DMA_BUF_SYNC_READ);
+}
+
+/* stops forwarding for good, the display goes on without the sink */
+static void sink_close(struct sink *k, struct stream *st)
+{
+	unsigned int i;
+
+	for (i = 0; i < MAX_SINK_BUFFERS; ++i) {
+		if (k->queued[i] && !k->copy)
+			buffer_unref(st, i);
+		k->queued[i] = 0;
+		if (k->map[i] && k->map[i] != MAP_FAILED)
+			munmap(k->map[i], k->length[i]);
+		k->map[i] = NULL;
+	}
+	close(k->fd);
+	k->fd = -1;
+}
+
+static void sink_dequeue(struct sink *k, struct stream *st)
+{
+	struct v4l2_buffer buf;
+
+	for (;;) {
+		memset(&buf, 0, sizeof buf);
+		buf.type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
+		buf.memory = k->copy ? V4L2_MEMORY_MMAP : V4L2_MEMORY_DMABUF;
+		if (ioctl(k->fd, VIDIOC_DQBUF, &buf))
+			break;
+
+		k->queued[buf.index] = 0;
+		if (!k->copy)
+			buffer_unref(st, buf.index);
+	}
+}
+
+/*
+ * Waits for the device only while it holds frames. Some devices, like
+ * v4l2loopback, always report POLLOUT and would keep poll() from blocking.
+ */
+static short sink_events(struct sink *k)
+{
+	unsigned int i;
+
+	for (i = 0; i < k->count; ++i)
+		if (k->queued[i])
+			return POLLOUT;
+	return 0;
+}
+
+/* frames arriving while their slot or every copy slot is busy are skipped */
+static void sink_frame(struct sink *k, struct stream *st, int index)
+{
+	struct buffer *b = &st->buffer[index];
+	struct v4l2_buffer buf;
+	unsigned int slot;
+	int ret;
+
+	if (k->fd < 0)
+		return;
+
+	if (++k->frames % 300 == 0) {
+		printf("sink: %u of the last 300 frames forwarded by %s\n",
+		       300 - k->skipped, k->copy ? "copy" : "dmabuf");
+		k->skipped = 0;
+	}
+
+	sink_dequeue(k, st);
+
+	memset(&buf, 0, sizeof buf);
+	buf.type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
+	buf.field = V4L2_FIELD_NONE;
+	buf.bytesused = k->sizeimage;
+	buf.timestamp.tv_sec = b->timestamp / 1000000;
+	buf.timestamp.tv_usec = b->timestamp % 1000000;
+
+retry:
+	if (k->copy) {
+		for (slot = 0; slot < k->count && k->queued[slot]; ++slot)
+			;
+		if (slot == k->count) {
+			k->skipped++;
+			return;
+		}
+		sink_copy(k, st, b, slot);
+		buf.index = slot;
+		buf.memory = V4L2_MEMORY_MMAP;
+	} else {
+		slot = index;
+		if (k->queued[slot]) {
+			k->skipped++;
+			return;
+		}
+		buf.index = slot;
+		buf.memory = V4L2_MEMORY_DMABUF;
+		buf.m.fd = b->dbuf_fd;
+	}
+
+	ret = ioctl(k->fd, VIDIOC_QBUF, &buf);
+	if (ret && !k->copy && errno == EINVAL) {
+		ret = sink_fallback(k, st, ERRSTR);
+		if (WARN_ON(ret, "sink: failed to set up copying, closing "
+			    "%s\n", k->node)) {
+			sink_close(k, st);
+			return;
+		}
+		goto retry;
+	}
+	if (WARN_ON(ret, "sink: VIDIOC_QBUF failed: %s\n", ERRSTR)) {
+		k->skipped++;
+		return;
+	}
+
+	k->queued[slot] = 1;
+	/* the output device reads the capture buffer until it is returned */
+	if (!k->copy)
+		b->refs++;
+}
+
+/*
+ * Leases the connector, the CRTC and every plane usable on it that no
+ * other worker holds yet. The objects are picked once and kept across
+ * respawns, so a restarted worker gets exactly what it had.
+ */
+static int lease_objects(int drmfd, struct lessee *l)
+{
+	drmModePlaneResPtr planes;
+	drmModeRes *res;
+	unsigned int i, j, k;
+	int crtc_idx = -1;
+
+	res = drmModeGetResources(drmfd);
+	if (WARN_ON(!res, "drmModeGetResources failed: %s\n", ERRSTR))
+		return -1;
+	for (i = 0; i < (unsigned int)res->count_crtcs; ++i)
+		if (res->crtcs[i] == l->crtcId)
+			crtc_idx = i;
+	drmModeFreeResources(res);
+	if (WARN_ON(crtc_idx < 0, "lease: CRTC %u not found\n", l->crtcId))
+		return -1;
+
+	planes = drmModeGetPlaneResources(drmfd);
+	if (WARN_ON(!planes, "drmModeGetPlaneResources failed: %s\n", ERRSTR))
+		return -1;
+
+	l->objects[l->count++] = l->conId;
+	l->objects[l->count++] = l->crtcId;
+	for (i = 0; i < planes->count_planes && l->count < MAX_LEASE_OBJECTS;
+	     ++i) {
+		drmModePlanePtr plane = drmModeGetPlane(drmfd, planes->planes[i]);
+		int taken = 0;
+
+		if (!plane)
+			continue;
+		for (j = 0; j < lessor.count; ++j)
+			for (k = 2; k < lessor.lessee[j].count; ++k)
+				if (lessor.lessee[j].objects[k] ==
+				    plane->plane_id)
+					taken = 1;
+		if (!taken && plane->possible_crtcs & (1 << crtc_idx))
+			l->objects[l->count++] = plane->plane_id;
+		drmModeFreePlane(plane);
+	}
+	drmModeFreePlaneResources(planes);
+
+	printf("lease: crtc %u gets connector %u and %u planes\n",
+	       l->crtcId, l->conId, l->count - 2);
+	return 0;
+}
+
+/*
+ * Runs a worker on a lease. The worker is this program again, told by -k
+ * to use the inherited lease fd instead of opening the device, followed
+ * by any arguments given after "--".
+ */
+static int lease_spawn(int drmfd, struct lessee *l)
+{
+	char fdarg[16], outarg[32];
+	char *args[64];
+	int fd, n = 0, i;
+
+	fd = drmModeCreateLease(drmfd, l->objects, l->count, 0, &l->id);
+	if (WARN_ON(fd < 0, "drmModeCreateLease failed: %s\n", strerror(-fd)))
+		return -1;
+
+	snprintf(fdarg, sizeof fdarg, "%d", fd);
+	snprintf(outarg, sizeof outarg, "%u:%u", l->conId, l->crtcId);
+	args[n++] = "dmabuf-sharing";
+	args[n++] = "-k";
+	args[n++] = fdarg;
+	args[n++] = "-o";
+	args[n++] = outarg;
+	args[n++] = "-i";
+	args[n++] = l->video;
+	for (i = 0; i < lessor.extra_count && n < 63; ++i)
+		args[n++] = lessor.extra[i];
+	args[n] = NULL;
+
+	l->pid = fork();
+	if (l->pid == 0) {
+		execv("/proc/self/exe", args);
+		fprintf(stderr, "lease: exec failed: %s\n", ERRSTR);
+		_exit(127);
+	}
+	close(fd);
+	if (WARN_ON(l->pid < 0, "fork failed: %s\n", ERRSTR)) {
+		drmModeRevokeLease(drmfd, l->id);
+		return -1;
+	}
+
+	printf("lease: worker %d shows %s on crtc %u, lessee %u\n", l->pid,
+	       l->video, l->crtcId, l->id);
+	return 0;
+}
+
+/*
+ * The lessor stays DRM master and only supervises. A worker that exits
+ * loses its lease right away, so nothing it left on screen can be
+ * updated by a stale fd, and one that crashed is restarted a few times.
+ */
+static int lessor_run(int drmfd)
+{
+	unsigned int i, running = 0;
+	int status;
+	pid_t pid;
+
+	drmSetClientCap(drmfd, DRM_CLIENT_CAP_UNIVERSAL_PLANES, 1);
+
+	for (i = 0; i < lessor.count; ++i)
+		if (lease_objects(drmfd, &lessor.lessee[i]))
+			return -1;
+
+	for (i = 0; i < lessor.count; ++i)
+		if (!lease_spawn(drmfd, &lessor.lessee[i]))
+			running++;
+
+	while (running && (pid = wait(&status)) > 0) {
+		struct lessee *l = NULL;
+		int crashed;
+
+		for (i = 0; i < lessor.count; ++i)
+			if (lessor.lessee[i].pid == pid)
+				l = &lessor.lessee[i];
+		if (!l)
+			continue;
+
+		drmModeRevokeLease(drmfd, l->id);
+		crashed = WIFSIGNALED(status) ||
+			(WIFEXITED(status) && WEXITSTATUS(status));
+		if (WIFSIGNALED(status))
+			printf("lease: worker %d killed by signal %d, lessee "
+			       "%u revoked\n", pid, WTERMSIG(status), l->id);
+		else
+			printf("lease: worker %d exited with %d, lessee %u "
+			       "revoked\n", pid, WEXITSTATUS(status), l->id);
+		l->pid = 0;
+
+		if (crashed && l->respawns < LEASE_RESPAWNS) {
+			l->respawns++;
+			if (!lease_spawn(drmfd, l))
+				continue;
+		}
+		running--;
+	}
+
+	return 0;
+}
+
+/*
+ * Imports a capture buffer into the second device, once per dmabuf.
+ * Entries are keyed by the dmabuf inode, which stays the same however
+ * many fds refer to it, and the least recently used one makes room.
+ */
+static int import_lookup(struct importer *im, struct stream *st,
+	struct buffer *b, uint32_t *fb)
+{
+	struct import_entry *e;
+	struct drm_prime_handle prime;
+	struct stat sb;
+	unsigned int i, lru = 0;
+	int ret;
+
+	ret = fstat(b->dbuf_fd, &sb);
+	if (WARN_ON(ret, "import: fstat failed: %s\n", ERRSTR))
+		return -1;
+
+	im->lookups++;
+	for (i = 0; i < im->count; ++i) {
+		e = &im->entry[i];
+		if (e->dev == sb.st_dev && e->ino == sb.st_ino) {
+			im->hits++;
+			e->last_use = ++im->tick;
+			*fb = e->fb;
+			return 0;
+		}
+		if (e->last_use < im->entry[lru].last_use)
+			lru = i;
+	}
+
+	if (im->count == MAX_IMPORTS)
+		import_evict(im, lru);
+
+	e = &im->entry[im->count];
+	memset(e, 0, sizeof *e);
+	e->dev = sb.st_dev;
+	e->ino = sb.st_ino;
+
+	memset(&prime, 0, sizeof prime);
+	prime.fd = b->dbuf_fd;
+	ret = ioctl(im->fd, DRM_IOCTL_PRIME_FD_TO_HANDLE, &prime);
+	if (WARN_ON(ret, "import: PRIME_FD_TO_HANDLE failed: %s\n", ERRSTR))
+		return -1;
+	e->handle = prime.handle;
+
+	/* devices without a display, like vgem, only import */
+	if (im->has_display) {
+		uint32_t offsets[4] = { 0 };
+		uint32_t pitches[4] = { st->pitch };
+		uint32_t bo_handles[4] = { e->handle };
+
+		ret = drmModeAddFB2(im->fd, st->w, st->h, st->fourcc,
+				    bo_handles, pitches, offsets, &e->fb, 0);
+		WARN_ON(ret, "import: drmModeAddFB2 failed: %s\n", ERRSTR);
+	}
+
+	e->last_use = ++im->tick;
+	im->count++;
+	im->imports++;
+	*fb = e->fb;
+	return 0;
+}
+
+/*
+ * Nothing modesets the second device, so frames can only be shown on a
+ * connector whose CRTC is already lit. Returns -1 if there is none.
+ */
+static int import_find_lit(int fd, struct output *out)
+{
+	drmModeRes *res = drmModeGetResources(fd);
+	int i;
+
+	if (!res)
+		return -1;
+
+	for (i = 0; i < res->count_connectors && !out->conId; ++i) {
+		drmModeConnector *con = drmModeGetConnector(fd,
+							    res->connectors[i]);
+		drmModeEncoder *enc = NULL;
+		drmModeCrtc *crtc = NULL;
+
+		if (con && con->encoder_id)
+			enc = drmModeGetEncoder(fd, con->encoder_id);
+		if (enc && enc->crtc_id)
+			crtc = drmModeGetCrtc(fd, enc->crtc_id);
+		if (crtc && crtc->mode_valid) {
+			out->conId = con->connector_id;
+			out->crtcId = crtc->crtc_id;
+		}
+
+		drmModeFreeCrtc(crtc);
+		drmModeFreeEncoder(enc);
+		drmModeFreeConnector(con);
+	}
+
+	drmModeFreeResources(res);
+	return out->conId ? 0 : -1;
+}
+
+/*
+ * The second device is found with the same helpers as the first one and
+ * shows frames with non-blocking atomic commits. Devices without atomic,
+ * without a lit CRTC, or without any, only import.
+ */
+static int import_setup(struct importer *im, const char *module)
+{
+	int ret;
+
+	im->fd = drmOpen(module, NULL);
+	if (WARN_ON(im->fd < 0, "drmOpen(%s) failed: %s\n", module, ERRSTR))
+		return -1;
+
+	memset(&im->setup, 0, sizeof im->setup);
+	im->out.conId = 0;
+	im->out.stream = &stream;
+	im->has_display = !import_find_lit(im->fd, &im->out);
+	if (!im->has_display) {
+		printf("import: %s has no lit display, importing only\n",
+		       module);
+		return 0;
+	}
+
+	if (drmSetClientCap(im->fd, DRM_CLIENT_CAP_ATOMIC, 1)) {
+		printf("import: %s has no atomic modesetting, importing only\n",
+		       module);
+		im->has_display = 0;
+		return 0;
+	}
+	im->setup.atomic = 1;
+
+	ret = find_crtc(im->fd, &im->setup, &im->out);
+	if (!ret)
+		ret = find_plane(im->fd, &im->setup, &im->out);
+	if (WARN_ON(ret, "import: no usable plane on %s\n", module))
+		return -1;
+
+	im->out.src_x = 0;
+	im->out.src_y = 0;
+	im->out.src_w = stream.w << 16;
+	im->out.src_h = stream.h << 16;
+	printf("import: showing frames on %s plane %u\n", module,
+	       im->out.planeId);
+	return 0;
+}
+
+/*
+ * Mirrors a frame on the second device with a non-blocking commit, so the
+ * capture loop never waits for its vblank. Frames arriving while a flip
+ * is pending are only imported. The flip event gives back the frame that
+ * was shown before.
+ */
+static void import_frame(struct importer *im, struct stream *st, int index)
+{
+	struct output *out = &im->out;
+	drmModeAtomicReq *req;
+	struct buffer b;
+	uint32_t fb;
+	int ret;
+
+	if (im->fd < 0 || import_lookup(im, st, &st->buffer[index], &fb))
+		return;
+
+	if (im->lookups % 300 == 0) {
+		printf("import: %u of the last 300 lookups hit, %u imports, "
+		       "%u evictions\n", im->hits, im->imports,
+		       im->evictions);
+		im->hits = 0;
+		im->imports = 0;
+		im->evictions = 0;
+	}
+
+	if (!im->has_display || !fb || out->pending != -1)
+		return;
+
+	req = drmModeAtomicAlloc();
+	if (WARN_ON(!req, "drmModeAtomicAlloc failed\n"))
+		return;
+
+	/* the framebuffer of the second device stands in for the frame */
+	memset(&b, 0, sizeof b);
+	b.fb_handle = fb;
+	display_fill(req, out, &b);
+	ret = drmModeAtomicCommit(im->fd, req, DRM_MODE_ATOMIC_NONBLOCK |
+				  DRM_MODE_PAGE_FLIP_EVENT, im);
+	drmModeAtomicFree(req);
+	if (ret && errno == EACCES) {
+		/* another master owns the display */
+		WARN_ON(1, "import: display is busy, importing only\n");
+		im->has_display = 0;
+		buffer_unref(st, out->shown);
+		out->shown = -1;
+		return;
+	}
+	if (WARN_ON(ret, "import: drmModeAtomicCommit failed: %s\n", ERRSTR))
+		return;
+
+	st->buffer[index].refs++;
+	out->pending = index;
+}
+
+static void import_flip_handler(int fd, unsigned int sequence,
+	unsigned int tv_sec, unsigned int tv_usec, unsigned int crtc_id,
+	void *user_data)
+{
+	struct importer *im = user_data;
+	struct output *out = &im->out;
+
+	(void)fd;
+	(void)sequence;
+	(void)tv_sec;
+	(void)tv_usec;
+	(void)crtc_id;
+
+	if (out->pending == -1)
+		return;
+	buffer_unref(out->stream, out->shown);
+	out->shown = out->pending;
+	out->pending = -1;
+}
+
+int main(int argc, char *argv[])
+{
+	int ret;
+	struct setup s;
+
+	ret = parse_args(argc, argv, &s);
+	BYE_ON(ret, "failed to parse arguments\n");
+
+	stream.name = "video";
+	pip.name = "pip";
+	stereo.name = "stereo";
+	overlay.name = "overlay";
+
+	if (s.replay[0]) {
+		ret = trace_replay(s.replay);
+		BYE_ON(ret, "failed to replay %s\n", s.replay);
+		return 0;
+	}
+
+	BYE_ON(s.module[0] == 0 && !s.use_lease, "DRM module is missing\n");
+
+	int drmfd = s.use_lease ? s.lease_fd : drmOpen(s.module, NULL);
+	BYE_ON(drmfd < 0, "drmOpen(%s) failed: %s\n", s.module, ERRSTR);
+
+	if (lessor.count) {
+		ret = lessor_run(drmfd);
+		BYE_ON(ret, "failed to lease outputs\n");
+		return 0;
+	}
+
+	BYE_ON(s.video[0] == 0, "video node is missing\n");
+
+	/* without -o a default connector is picked */
+	if (!s.out_count)
+		s.out_count = 1;
+
+	BYE_ON(s.wall_cols && s.wall_cols * s.wall_rows != s.out_count,
+	       "video wall needs %u outputs\n", s.wall_cols * s.wall_rows);
+	BYE_ON(s.stereo[0] && (s.pip[0] || s.wall_cols || s.tile_width ||
+			       s.out_count > 2),
+	       "stereo needs one or two outputs and no other layout\n");
+	BYE_ON(mux.count && (s.pip[0] || s.stereo[0] || s.wall_cols ||
+			     s.tile_width || s.out_count > 1),
+	       "input multiplexing needs one output and no other layout\n");
+
+	/* cloning, walls, tiling and extra planes update several at once */
+	if (s.out_count > 1 || s.tile_width || s.pip[0] || s.stereo[0] ||
+	    mux.count > 1 || s.use_overlay || s.use_damage)
+		s.atomic = 1;
+
+	if (s.atomic) {
+		ret = drmSetClientCap(drmfd, DRM_CLIENT_CAP_ATOMIC, 1);
+		BYE_ON(ret, "atomic modesetting is not supported: %s\n",
+		       ERRSTR);
+	}
+
+	if (s.async) {
+		uint64_t cap = 0;
+
+		drmGetCap(drmfd, s.atomic ? DRM_CAP_ATOMIC_ASYNC_PAGE_FLIP :
+			  DRM_CAP_ASYNC_PAGE_FLIP, &cap);
+		if (WARN_ON(!cap, "async flips are not supported, "
+			    "waiting for vblank\n"))
+			s.async = 0;
+	}
+
+	int v4lfd = open(s.video, O_RDWR);
+	BYE_ON(v4lfd < 0, "failed to open %s: %s\n", s.video, ERRSTR);
+
+	struct v4l2_capability caps;
+	memset(&caps, 0, sizeof caps);
+
+	ret = ioctl(v4lfd, VIDIOC_QUERYCAP, &caps);
+	BYE_ON(ret, "VIDIOC_QUERYCAP failed: %s\n", ERRSTR);
+
+	/* TODO: add single plane support */
+	BYE_ON(~caps.capabilities & V4L2_CAP_VIDEO_CAPTURE,
+		"video: singleplanar capture is not supported\n");
+
+	for (unsigned int i = 0; i < s.out_count; ++i) {
+		ret = find_crtc(drmfd, &s, &s.out[i]);
+		BYE_ON(ret, "failed to find valid mode\n");
+	}
+
+	struct v4l2_format fmt;
+	memset(&fmt, 0, sizeof fmt);
+	fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
 
 	ret = ioctl(v4lfd, VIDIOC_G_FMT, &fmt);
 	BYE_ON(ret < 0, "VIDIOC_G_FMT failed: %s\n", ERRSTR);
@@ -437,103 +5256,299 @@ int main(int argc, char *argv[])
 	ret = ioctl(v4lfd, VIDIOC_S_FMT, &fmt);
 	BYE_ON(ret < 0, "VIDIOC_S_FMT failed: %s\n", ERRSTR);
 
+	if (!s.use_wh)
+		negotiate_downscale(v4lfd, &s, &fmt);
+
 	ret = ioctl(v4lfd, VIDIOC_G_FMT, &fmt);
 	BYE_ON(ret < 0, "VIDIOC_G_FMT failed: %s\n", ERRSTR);
 	printf("G_FMT(final): width = %u, height = %u, 4cc = %.4s\n",
 		fmt.fmt.pix.width, fmt.fmt.pix.height,
 		(char*)&fmt.fmt.pix.pixelformat);
 
-	struct v4l2_requestbuffers rqbufs;
-	memset(&rqbufs, 0, sizeof(rqbufs));
-	rqbufs.count = s.buffer_count;
-	rqbufs.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-	rqbufs.memory = V4L2_MEMORY_DMABUF;
-
-	ret = ioctl(v4lfd, VIDIOC_REQBUFS, &rqbufs);
-	BYE_ON(ret < 0, "VIDIOC_REQBUFS failed: %s\n", ERRSTR);
-	BYE_ON(rqbufs.count < s.buffer_count, "video node allocated only "
-		"%u of %u buffers\n", rqbufs.count, s.buffer_count);
+	negotiate_frame_interval(v4lfd, &s, &fmt);
 
 	s.in_fourcc = fmt.fmt.pix.pixelformat;
+	if (!s.out_fourcc)
+		s.out_fourcc = s.in_fourcc;
 	s.w = fmt.fmt.pix.width;
 	s.h = fmt.fmt.pix.height;
+	wall_layout(&s);
 
-	/* TODO: add support for multiplanar formats */
-	struct buffer buffer[s.buffer_count];
-	uint32_t size = fmt.fmt.pix.sizeimage;
-	uint32_t pitch = fmt.fmt.pix.bytesperline;
-	printf("size = %u pitch = %u\n", size, pitch);
-	for (unsigned int i = 0; i < s.buffer_count; ++i) {
-		ret = buffer_create(&buffer[i], drmfd, &s, size, pitch);
-		BYE_ON(ret, "failed to create buffer%d\n", i);
+	stream.fourcc = s.out_fourcc;
+	for (unsigned int i = 0; i < s.out_count; ++i) {
+		s.out[i].stream = &stream;
+		ret = find_plane(drmfd, &s, &s.out[i]);
+		if (ret)
+			ret = find_primary(drmfd, &s, &s.out[i]);
+		BYE_ON(ret, "failed to find compatible plane for crtc %u\n",
+		       s.out[i].crtcId);
 	}
-	printf("buffers ready\n");
 
-	uint32_t con;
-	ret = find_crtc(drmfd, &s, &con);
-	BYE_ON(ret, "failed to find valid mode\n");
+	ret = tile_to_width(drmfd, &s);
+	BYE_ON(ret, "failed to split frame across planes\n");
 
-	ret = find_plane(drmfd, &s);
-	BYE_ON(ret, "failed to find compatible plane\n");
+	if (s.plan) {
+		plan_print(&s, &fmt);
+		return 0;
+	}
 
-	for (unsigned int i = 0; i < s.buffer_count; ++i) {
-		struct v4l2_buffer buf;
-		memset(&buf, 0, sizeof buf);
+	stream.v4lfd = v4lfd;
+	ret = stream_alloc(drmfd, &stream, &fmt, s.out_fourcc, s.buffer_count);
+	BYE_ON(ret, "failed to allocate buffers\n");
+	BYE_ON(s.media[0] && !(stream.caps & V4L2_BUF_CAP_SUPPORTS_REQUESTS),
+		"video node does not support requests\n");
 
-		buf.index = i;
-		buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-		buf.memory = V4L2_MEMORY_DMABUF;
-		buf.m.fd = buffer[i].dbuf_fd;
-		ret = ioctl(v4lfd, VIDIOC_QBUF, &buf);
-		BYE_ON(ret < 0, "VIDIOC_QBUF for buffer %d failed: %s (fd %u)\n",
-			buf.index, ERRSTR, buffer[i].dbuf_fd);
+	/* damage, deduplication, analysis and previews read frames */
+	for (int i = 0; (s.use_damage || s.dedup_stride || s.analyze ||
+			 s.thumb[0]) &&
+	     i < stream.buffer_count; ++i) {
+		ret = buffer_map(drmfd, &stream.buffer[i],
+				 stream.pitch * stream.h);
+		BYE_ON(ret, "failed to map buffer %d\n", i);
 	}
 
-	int type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-	ret = ioctl(v4lfd, VIDIOC_STREAMON, &type);
-	BYE_ON(ret < 0, "STREAMON failed: %s\n", ERRSTR);
+	if (mux.count) {
+		ret = mux_setup(drmfd, &s, v4lfd);
+		BYE_ON(ret, "failed to set up input multiplexing\n");
+	}
+
+	pip.v4lfd = -1;
+	if (s.pip[0]) {
+		ret = pip_setup(drmfd, &s, &pip);
+		BYE_ON(ret, "failed to set up picture-in-picture\n");
+	}
+
+	stereo.v4lfd = -1;
+	pairing.waiting[0] = -1;
+	pairing.waiting[1] = -1;
+	if (s.stereo[0]) {
+		ret = stereo_setup(drmfd, &s, &stereo);
+		BYE_ON(ret, "failed to set up stereo capture\n");
+	}
+
+	if (s.thumb[0]) {
+		/* picture-in-picture and stereo exclude each other */
+		struct stream *second = stereo.v4lfd >= 0 ? &stereo : &pip;
+		struct stream *captured[THUMB_MAX_STREAMS] = { &stream, second };
+
+		for (int i = 0; second->v4lfd >= 0 &&
+		     i < second->buffer_count; ++i) {
+			ret = buffer_map(drmfd, &second->buffer[i],
+					 second->pitch * second->h);
+			BYE_ON(ret, "failed to map buffer %d\n", i);
+		}
+
+		ret = thumb_setup(&s, captured, second->v4lfd >= 0 ? 2 : 1);
+		BYE_ON(ret, "failed to set up previews\n");
+	}
+
+	if (s.use_overlay) {
+		ret = overlay_setup(drmfd, &s, &overlay);
+		BYE_ON(ret, "failed to set up statistics overlay\n");
+	}
+
+	/* legacy primary planes flip whole frames and are never split */
+	if (!s.atomic && !s.out[0].primary)
+		s.atomic = atomic_probe(drmfd, &s);
+
+	if (s.atomic) {
+		ret = tile_outputs(drmfd, &s);
+		BYE_ON(ret, "failed to configure planes\n");
+	}
+
+	/* the kernel flips nothing but primary planes without vblank */
+	for (unsigned int i = 0; s.async && i < s.out_count; ++i)
+		if (WARN_ON(!s.out[i].primary, "async flips only work on "
+			    "primary planes, waiting for vblank\n"))
+			s.async = 0;
+
+	if (s.media[0]) {
+		ret = request_setup(&stream, s.media);
+		BYE_ON(ret, "failed to set up requests\n");
+	}
+
+	if (s.trace[0]) {
+		stats.trace = fopen(s.trace, "w");
+		BYE_ON(!stats.trace, "failed to open %s: %s\n", s.trace,
+		       ERRSTR);
+		/* an interrupted run keeps everything up to the last line */
+		setvbuf(stats.trace, NULL, _IOLBF, 0);
+		fprintf(stats.trace, "# %s %u\n", s.async ? "async" : "vsync",
+			s.vrefresh);
+	}
+
+	control.fd = -1;
+	if (s.control[0]) {
+		ret = control_setup(&control, s.control);
+		BYE_ON(ret, "failed to set up control socket\n");
+	}
+
+	analyzer.notify[0] = -1;
+	if (s.analyze) {
+		ret = analyzer_setup(&analyzer, &stream, s.in_fourcc);
+		BYE_ON(ret, "failed to set up frame analysis\n");
+	}
+
+	if (s.import[0]) {
+		ret = import_setup(&importer, s.import);
+		BYE_ON(ret, "failed to set up import into %s\n", s.import);
+	}
+
+	sink.fd = -1;
+	if (sink.node[0]) {
+		ret = sink_setup(&sink, drmfd, &stream, s.in_fourcc);
+		BYE_ON(ret, "failed to set up output to %s\n", sink.node);
+	}
+
+	if (s.meta[0]) {
+		ret = meta_setup(&stream.meta, s.meta, s.buffer_count);
+		BYE_ON(ret, "failed to set up metadata capture\n");
+	}
+
+	if (stream.meta.fd >= 0) {
+		int type = V4L2_BUF_TYPE_META_CAPTURE;
+		ret = ioctl(stream.meta.fd, VIDIOC_STREAMON, &type);
+		BYE_ON(ret < 0, "meta: STREAMON failed: %s\n", ERRSTR);
+	}
+
+	ret = stream_start(&stream);
+	BYE_ON(ret, "failed to start streaming\n");
+
+	if (stereo.v4lfd >= 0) {
+		ret = stream_start(&stereo);
+		BYE_ON(ret, "failed to start stereo capture\n");
+	}
+
+	if (pip.v4lfd >= 0) {
+		ret = stream_start(&pip);
+		BYE_ON(ret, "failed to start picture-in-picture\n");
+	}
+
+	if (s.use_qos) {
+		qos.stream[qos.count++] = &stream;
+		if (pip.v4lfd >= 0)
+			qos.stream[qos.count++] = &pip;
+		qos.top = stream.priority;
+		if (pip.v4lfd >= 0 && pip.priority < qos.top)
+			qos.top = pip.priority;
+	}
 
-	struct pollfd fds[] = {
-		{ .fd = v4lfd, .events = POLLIN },
-		{ .fd = drmfd, .events = POLLIN },
+	/* unused entries have a negative fd and are ignored by poll() */
+	enum { POLL_VIDEO, POLL_DRM, POLL_META, POLL_CONTROL, POLL_PIP,
+	       POLL_ANALYZER, POLL_STEREO, POLL_SINK, POLL_IMPORT, POLL_COUNT };
+	struct pollfd fds[POLL_COUNT] = {
+		[POLL_VIDEO] = { .fd = v4lfd, .events = POLLIN },
+		[POLL_PIP] = { .fd = pip.v4lfd, .events = POLLIN },
+		[POLL_STEREO] = { .fd = stereo.v4lfd, .events = POLLIN },
+		[POLL_SINK] = { .fd = sink.fd },
+		[POLL_IMPORT] = { .fd = importer.has_display ? importer.fd : -1,
+				  .events = POLLIN },
+		[POLL_DRM] = { .fd = drmfd, .events = POLLIN },
+		[POLL_META] = { .fd = stream.meta.fd, .events = POLLIN },
+		[POLL_CONTROL] = { .fd = control.fd, .events = POLLIN },
+		[POLL_ANALYZER] = { .fd = analyzer.notify[0], .events = POLLIN },
 	};
 
-	/* buffer currently used by drm */
-	stream.v4lfd = v4lfd;
-	stream.current_buffer = -1;
-	stream.buffer = buffer;
+	while ((ret = qos_poll(fds, POLL_COUNT, 5000)) > 0) {
+		int index;
 
-	while ((ret = poll(fds, 2, 5000)) > 0) {
-		struct v4l2_buffer buf;
+		if (s.use_qos)
+			qos_update();
 
-		/* dequeue buffer */
-		memset(&buf, 0, sizeof buf);
-		buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-		buf.memory = V4L2_MEMORY_DMABUF;
-		ret = ioctl(v4lfd, VIDIOC_DQBUF, &buf);
-		BYE_ON(ret, "VIDIOC_DQBUF failed: %s\n", ERRSTR);
-
-		ret = drmModeSetPlane(drmfd, s.planeId, s.crtcId,
-				      buffer[buf.index].fb_handle, 0,
-				      s.compose.left, s.compose.top,
-				      s.compose.width,
-				      s.compose.height,
-				      0, 0, s.w << 16, s.h << 16);
-		BYE_ON(ret, "drmModeSetPlane failed: %s\n", ERRSTR);
+		if (fds[POLL_CONTROL].revents & POLLIN)
+			control_handle(&control, &stream);
+
+		if (fds[POLL_DRM].revents & POLLIN) {
+			drmEventContext ev = {
+				.version = 3,
+				.page_flip_handler2 = page_flip_handler,
+			};
+
+			ret = drmHandleEvent(drmfd, &ev);
+			BYE_ON(ret, "drmHandleEvent failed: %s\n", ERRSTR);
+		}
+
+		if (fds[POLL_IMPORT].revents & POLLIN) {
+			drmEventContext ev = {
+				.version = 3,
+				.page_flip_handler2 = import_flip_handler,
+			};
+
+			ret = drmHandleEvent(importer.fd, &ev);
+			WARN_ON(ret, "import: drmHandleEvent failed: %s\n",
+				ERRSTR);
+		}
+
+		if (fds[POLL_SINK].revents & POLLOUT) {
+			sink_dequeue(&sink, &stream);
+			fds[POLL_SINK].events = sink_events(&sink);
+		}
 
-		if (stream.current_buffer != -1) {
-			memset(&buf, 0, sizeof buf);
-			buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-			buf.memory = V4L2_MEMORY_DMABUF;
-			buf.index = stream.current_buffer;
-			buf.m.fd = stream.buffer[stream.current_buffer].dbuf_fd;
+		if (fds[POLL_ANALYZER].revents & POLLIN)
+			analyzer_handle(&analyzer, &stream);
 
-			ret = ioctl(stream.v4lfd, VIDIOC_QBUF, &buf);
-			BYE_ON(ret, "VIDIOC_QBUF(index = %d) failed: %s\n",
-			       stream.current_buffer, ERRSTR);
+		if (fds[POLL_META].revents & POLLIN) {
+			while (meta_dequeue(&stream.meta) >= 0)
+				;
+			if (stream.current_buffer != -1)
+				meta_match(&stream.meta,
+					&stream.buffer[stream.current_buffer]);
 		}
 
-		stream.current_buffer = buf.index;
+		if (fds[POLL_PIP].revents & POLLIN) {
+			index = video_dequeue(&pip);
+			if (!qos_skip(&pip, index)) {
+				display_frame(drmfd, &s, &pip, index);
+				thumb_update(&s, &pip, index);
+			}
+		}
+
+		if (fds[POLL_STEREO].revents & POLLIN) {
+			index = video_dequeue(&stereo);
+			stereo_frame(drmfd, &s, &stereo, index);
+			if (stereo.buffer[index].refs)
+				thumb_update(&s, &stereo, index);
+		}
+
+		if (!(fds[POLL_VIDEO].revents & POLLIN))
+			continue;
+
+		index = video_dequeue(&stream);
+		stats_capture(&stream.buffer[index]);
+		if (s.use_drift) {
+			fit_add(&drift.capture, stream.buffer[index].sequence,
+				stream.buffer[index].timestamp);
+			drift_update(&s, &drift, v4lfd);
+		}
+		if (s.skip > 1 && stream.buffer[index].sequence % s.skip) {
+			ret = video_queue(&stream, index);
+			BYE_ON(ret, "failed to requeue buffer %d\n", index);
+			continue;
+		}
+
+		if (qos_skip(&stream, index) || frame_dedup(&s, &stream, index))
+			continue;
+
+		if (stream.meta.fd >= 0)
+			meta_match(&stream.meta, &stream.buffer[index]);
+
+		if (mux.count)
+			mux_frame(drmfd, &s, index);
+		else if (stereo.v4lfd >= 0)
+			stereo_frame(drmfd, &s, &stream, index);
+		else
+			display_frame(drmfd, &s, &stream, index);
+
+		/* unchanged or unpaired frames may be back in the driver */
+		if (stream.buffer[index].refs) {
+			analyzer_submit(&analyzer, &stream, index);
+			thumb_update(&s, &stream, index);
+			sink_frame(&sink, &stream, index);
+			/* a failing sink is closed and no longer polled */
+			fds[POLL_SINK].fd = sink.fd;
+			fds[POLL_SINK].events = sink_events(&sink);
+			import_frame(&importer, &stream, index);
+		}
 	}
 
 	return 0;